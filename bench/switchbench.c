@@ -0,0 +1,179 @@
+/* switchbench - time the desktop switches of a running monsterwm
+ *
+ * maps n windows on each of the first two desktops, then switches between
+ * them with fake MOD1+F1 and MOD1+F2 presses, the default DESKTOPCHANGE keys,
+ * a switch is done when the windows of the new desktop are all mapped and
+ * on screen, and the ones of the old desktop are unmapped or parked
+ * every expose of the windows is answered with a redraw that takes the
+ * given time, like a client that lost its contents has to
+ *
+ * see bench/switchbench.sh to run it against both switch modes under Xvfb
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <stdlib.h>
+#include <stdio.h>
+#include <err.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <time.h>
+#include <X11/keysym.h>
+#include <xcb/xcb.h>
+#include <xcb/xtest.h>
+#include <xcb/xcb_keysyms.h>
+
+/* a window of the benchmark
+ * mapped - whether the last map or unmap notify was a map
+ * x      - the x coordinate of the last configure notify
+ */
+typedef struct {
+    xcb_window_t win;
+    bool mapped;
+    int x;
+} window;
+
+static xcb_connection_t *dis;
+static xcb_screen_t *screen;
+static xcb_gcontext_t gc;
+static window *windows;
+static unsigned int nwindows, exposes;
+static long redraw; /* the time a redraw takes in microseconds */
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static int cmp(const void *a, const void *b) {
+    return (*(const double*)a > *(const double*)b) - (*(const double*)a < *(const double*)b);
+}
+
+static window* find(xcb_window_t w) {
+    for (unsigned int i = 0; i < nwindows; i++) if (windows[i].win == w) return &windows[i];
+    return NULL;
+}
+
+static void handle(xcb_generic_event_t *e) {
+    window *w = NULL;
+    switch (e->response_type & ~0x80) {
+        case XCB_MAP_NOTIFY:
+            if ((w = find(((xcb_map_notify_event_t*)e)->window))) w->mapped = true;
+            break;
+        case XCB_UNMAP_NOTIFY:
+            if ((w = find(((xcb_unmap_notify_event_t*)e)->window))) w->mapped = false;
+            break;
+        case XCB_CONFIGURE_NOTIFY:
+            if ((w = find(((xcb_configure_notify_event_t*)e)->window))) w->x = ((xcb_configure_notify_event_t*)e)->x;
+            break;
+        case XCB_EXPOSE: {
+            xcb_expose_event_t *ev = (xcb_expose_event_t*)e;
+            if (ev->count) break;
+            exposes++;
+            if (redraw) nanosleep(&(struct timespec){ redraw / 1000000, redraw % 1000000 * 1000 }, NULL);
+            xcb_poly_fill_rectangle(dis, ev->window, gc, 1, &(xcb_rectangle_t){ 0, 0, 16, 16 });
+            xcb_flush(dis);
+            break;
+        }
+    }
+}
+
+/* whether the windows from first to first+count are all shown, or all hidden */
+static bool settled(unsigned int first, unsigned int count, bool shown) {
+    for (unsigned int i = first; i < first + count; i++)
+        if (shown != (windows[i].mapped && windows[i].x < screen->width_in_pixels)) return false;
+    return true;
+}
+
+/* handle events until the windows from first to first+count are shown, or hidden */
+static void wait_for(unsigned int first, unsigned int count, bool shown) {
+    for (xcb_generic_event_t *e = NULL; !settled(first, count, shown); free(e)) {
+        if (!(e = xcb_wait_for_event(dis))) errx(EXIT_FAILURE, "lost the connection to the X server");
+        handle(e);
+    }
+}
+
+/* handle the events that came along with the last changes, like the exposes */
+static void drain(void) {
+    free(xcb_get_input_focus_reply(dis, xcb_get_input_focus(dis), NULL));
+    for (xcb_generic_event_t *e = NULL; (e = xcb_poll_for_event(dis)); free(e)) handle(e);
+}
+
+/* press and release the key with the modifier held, as a user would */
+static void key(xcb_keycode_t mod, xcb_keycode_t code) {
+    xcb_test_fake_input(dis, XCB_KEY_PRESS,   mod,  XCB_CURRENT_TIME, XCB_NONE, 0, 0, 0);
+    xcb_test_fake_input(dis, XCB_KEY_PRESS,   code, XCB_CURRENT_TIME, XCB_NONE, 0, 0, 0);
+    xcb_test_fake_input(dis, XCB_KEY_RELEASE, code, XCB_CURRENT_TIME, XCB_NONE, 0, 0, 0);
+    xcb_test_fake_input(dis, XCB_KEY_RELEASE, mod,  XCB_CURRENT_TIME, XCB_NONE, 0, 0, 0);
+    xcb_flush(dis);
+}
+
+static xcb_keycode_t keycode(xcb_key_symbols_t *keysyms, xcb_keysym_t keysym) {
+    xcb_keycode_t *codes = xcb_key_symbols_get_keycode(keysyms, keysym), code = 0;
+    if (codes) code = codes[0];
+    free(codes);
+    if (!code) errx(EXIT_FAILURE, "no keycode for keysym 0x%x", keysym);
+    return code;
+}
+
+int main(int argc, char *argv[]) {
+    unsigned int n = 20, rounds = 100;
+    for (int opt; (opt = getopt(argc, argv, "n:r:d:")) != -1;) switch (opt) {
+        case 'n': n = strtoul(optarg, NULL, 10); break;
+        case 'r': rounds = strtoul(optarg, NULL, 10); break;
+        case 'd': redraw = strtol(optarg, NULL, 10); break;
+        default: errx(EXIT_FAILURE, "usage: switchbench [-n windows per desktop] [-r switches] [-d redraw usec]");
+    }
+    if (!n || !rounds) errx(EXIT_FAILURE, "need at least one window and one switch");
+
+    if (xcb_connection_has_error((dis = xcb_connect(NULL, NULL)))) errx(EXIT_FAILURE, "cannot open display");
+    if (!xcb_get_extension_data(dis, &xcb_test_id)->present) errx(EXIT_FAILURE, "the server has no XTEST");
+    screen = xcb_setup_roots_iterator(xcb_get_setup(dis)).data;
+
+    xcb_key_symbols_t *keysyms = xcb_key_symbols_alloc(dis);
+    xcb_keycode_t alt = keycode(keysyms, XK_Alt_L), desktop[2] = { keycode(keysyms, XK_F1), keycode(keysyms, XK_F2) };
+    xcb_key_symbols_free(keysyms);
+
+    gc = xcb_generate_id(dis);
+    xcb_create_gc(dis, gc, screen->root, XCB_GC_FOREGROUND, (uint32_t[]){ screen->black_pixel });
+    if (!(windows = calloc((nwindows = 2 * n), sizeof(window)))) err(EXIT_FAILURE, "calloc");
+    for (unsigned int i = 0; i < nwindows; i++) {
+        windows[i].win = xcb_generate_id(dis);
+        xcb_create_window(dis, XCB_COPY_FROM_PARENT, windows[i].win, screen->root, 0, 0, 100, 100, 0,
+                          XCB_WINDOW_CLASS_INPUT_OUTPUT, screen->root_visual, XCB_CW_BACK_PIXEL|XCB_CW_EVENT_MASK,
+                          (uint32_t[]){ screen->white_pixel, XCB_EVENT_MASK_EXPOSURE|XCB_EVENT_MASK_STRUCTURE_NOTIFY });
+    }
+
+    /* the first n windows go on the first desktop, the others on the second */
+    key(alt, desktop[0]);
+    for (unsigned int i = 0; i < n; i++) xcb_map_window(dis, windows[i].win);
+    xcb_flush(dis);
+    wait_for(0, n, true);
+    key(alt, desktop[1]);
+    wait_for(0, n, false);
+    for (unsigned int i = n; i < nwindows; i++) xcb_map_window(dis, windows[i].win);
+    xcb_flush(dis);
+    wait_for(n, n, true);
+    drain();
+
+    double *times = NULL, total = 0;
+    if (!(times = malloc(rounds * sizeof(double)))) err(EXIT_FAILURE, "malloc");
+    exposes = 0;
+    for (unsigned int r = 0; r < rounds; r++) {
+        unsigned int to = r % 2 ? 1 : 0, from = !to;
+        double start = now();
+        key(alt, desktop[to]);
+        wait_for(to * n, n, true);
+        wait_for(from * n, n, false);
+        drain();
+        total += (times[r] = now() - start);
+    }
+
+    qsort(times, rounds, sizeof(double), cmp);
+    printf("%u windows per desktop, %u switches: min %.2f median %.2f mean %.2f max %.2f ms, %.1f exposes per switch\n",
+           n, rounds, times[0], times[rounds / 2], total / rounds, times[rounds - 1], (double)exposes / rounds);
+
+    free(times);
+    free(windows);
+    xcb_disconnect(dis);
+    return EXIT_SUCCESS;
+}
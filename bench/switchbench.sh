@@ -0,0 +1,33 @@
+#!/bin/sh
+# compare the desktop switch latency of monsterwm with PARK_HIDDEN off and on
+# builds both from config.def.h and runs bench/switchbench against each under Xvfb
+# needs Xvfb and the xcb, xcb-icccm, xcb-keysyms and xcb-xtest development files
+# usage: bench/switchbench.sh [-n windows per desktop] [-r switches] [-d redraw usec]
+
+set -e
+cd "$(dirname "$0")/.."
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+display=${BENCH_DISPLAY:-:99}
+
+cc -std=c99 -O2 -o "$tmp/switchbench" bench/switchbench.c `pkg-config --cflags --libs xcb xcb-xtest xcb-keysyms`
+
+for park in False True; do
+    mkdir "$tmp/$park"
+    cp monsterwm.c "$tmp/$park"
+    sed "s/^\(#define PARK_HIDDEN *\)[A-Za-z]*/\1$park/" config.def.h > "$tmp/$park/config.h"
+    cc -std=c99 -O2 -DVERSION=\"bench\" -DWMNAME=\"monsterwm\" -o "$tmp/$park/monsterwm" "$tmp/$park/monsterwm.c" \
+        `pkg-config --cflags --libs xcb xcb-icccm xcb-keysyms`
+
+    Xvfb "$display" -screen 0 1280x1024x24 -nolisten tcp >/dev/null 2>&1 &
+    xvfb=$!
+    sleep 1
+    DISPLAY=$display "$tmp/$park/monsterwm" >/dev/null &
+    wm=$!
+    sleep 1
+    printf 'PARK_HIDDEN %-5s ' "$park"
+    DISPLAY=$display "$tmp/switchbench" "$@" || status=$?
+    kill $wm $xvfb
+    wait $wm $xvfb 2>/dev/null || true
+    [ -z "$status" ] || exit $status
+done
@@ -25,6 +25,9 @@
 #define DESKTOPS        4         /* number of desktops - edit DESKTOPCHANGE keys to suit */
 #define DEFAULT_DESKTOP 0         /* the desktop to focus on exec */
 #define MINWSZ          50        /* minimum window size in pixels */
+#define DRAG_RATE       60        /* max moves/resizes per second when dragging a window */
+#define MONOCLE_PRESIZE False     /* in monocle mode also size the windows next to the current one */
+#define PARK_HIDDEN     False     /* keep windows of hidden desktops mapped off screen instead of unmapped */
 
 /* open applications to specified desktop with specified mode.
  * if desktop is negative, then current is assumed */
@@ -1,5 +1,7 @@
 /* see license for copyright and license */
 
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <err.h>
@@ -8,9 +10,15 @@
 #include <unistd.h>
 #include <string.h>
 #include <signal.h>
+#include <errno.h>
+#include <poll.h>
 #include <sys/wait.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
 #include <X11/keysym.h>
 #include <xcb/xcb.h>
+#include <xcb/xcbext.h>
 #include <xcb/xcb_atom.h>
 #include <xcb/xcb_icccm.h>
 #include <xcb/xcb_keysyms.h>
@@ -37,22 +45,35 @@
 #define Button2      XCB_BUTTON_INDEX_2
 #define Button3      XCB_BUTTON_INDEX_3
 #define XCB_MOVE_RESIZE XCB_CONFIG_WINDOW_X | XCB_CONFIG_WINDOW_Y | XCB_CONFIG_WINDOW_WIDTH | XCB_CONFIG_WINDOW_HEIGHT
-#define XCB_MOVE        XCB_CONFIG_WINDOW_X | XCB_CONFIG_WINDOW_Y
-#define XCB_RESIZE      XCB_CONFIG_WINDOW_WIDTH | XCB_CONFIG_WINDOW_HEIGHT
 
-static char *WM_ATOM_NAME[]   = { "WM_PROTOCOLS", "WM_DELETE_WINDOW" };
-static char *NET_ATOM_NAME[]  = { "_NET_SUPPORTED", "_NET_WM_STATE_FULLSCREEN", "_NET_WM_STATE", "_NET_ACTIVE_WINDOW" };
+static char *WM_ATOM_NAME[]   = { "WM_PROTOCOLS", "WM_DELETE_WINDOW", "WM_STATE" };
+static char *NET_ATOM_NAME[]  = { "_NET_SUPPORTED", "_NET_WM_STATE_FULLSCREEN", "_NET_WM_STATE", "_NET_ACTIVE_WINDOW",
+                                  "_NET_WM_STATE_HIDDEN" };
+
+/* the properties whose changes are handled, along with _NET_WM_STATE, see propertynotify()
+ * changes of any other property, like a window's title, are dropped unseen */
+static const xcb_atom_t WATCHED_ATOMS[] = { XCB_ATOM_WM_HINTS, XCB_ATOM_WM_CLASS, XCB_ATOM_WM_TRANSIENT_FOR };
 
 #define LENGTH(x) (sizeof(x)/sizeof(*x))
 #define CLEANMASK(mask) (mask & ~(numlockmask | XCB_MOD_MASK_LOCK))
+#define BINDCODE(isbutton, detail, mask) ((isbutton) << 31 | (detail) << 16 | CLEANMASK(mask))
 #define BUTTONMASK      XCB_EVENT_MASK_BUTTON_PRESS|XCB_EVENT_MASK_BUTTON_RELEASE
-#define ISFFT(c)        (c->isfullscrn || c->isfloating || c->istransient)
+#define ISFFT(c)        ((c)->flags & (FULLSCRN|FLOATING|TRANSIENT))
+#define PARKX(c)        (PARK_HIDDEN && (c)->flags & HIDDEN ? 2*screen->width_in_pixels:0) /* x offset of a parked window */
 #define USAGE           "usage: monsterwm [-h] [-v]"
+#define PREFETCH        32  /* number of created windows whose properties are prefetched */
+#define WMSTATES        8   /* number of a client's own _NET_WM_STATE atoms that are kept */
+#define SOURCES         8   /* number of file descriptors run() can wait on */
+#define BATCH           128 /* number of events read and coalesced at once */
+#define SLAB            64  /* number of clients allocated at once */
 
 enum { RESIZE, MOVE };
+enum { NEED_TILE = 1<<0, NEED_FOCUS = 1<<1 };
+enum { URGENT = 1<<0, TRANSIENT = 1<<1, FULLSCRN = 1<<2, FLOATING = 1<<3, CLICKGRAB = 1<<4, HIDDEN = 1<<5, MAPPING = 1<<6 };
+enum { PRIO_INPUT, PRIO_STRUCTURE, PRIO_OTHER };
 enum { TILE, MONOCLE, BSTACK, GRID, MODES };
-enum { WM_PROTOCOLS, WM_DELETE_WINDOW, WM_COUNT };
-enum { NET_SUPPORTED, NET_FULLSCREEN, NET_WM_STATE, NET_ACTIVE, NET_COUNT };
+enum { WM_PROTOCOLS, WM_DELETE_WINDOW, WM_STATE, WM_COUNT };
+enum { NET_SUPPORTED, NET_FULLSCREEN, NET_WM_STATE, NET_ACTIVE, NET_HIDDEN, NET_COUNT };
 
 /* argument structure to be passed to function by config.h
  * com  - a command to run
@@ -88,25 +109,77 @@ typedef struct {
     const Arg arg;
 } Button;
 
+/* a binding is an entry of the key and button dispatch table
+ * code     - the keycode or button with the cleaned modifier mask, see BINDCODE
+ *            zero marks a free slot, as no keycode or button is zero
+ * func     - the function to be triggered by that combo
+ * arg      - the argument to the function
+ */
+typedef struct {
+    unsigned int code;
+    void (*func)(const Arg *);
+    const Arg *arg;
+} binding;
+
 /* a client is a wrapper to a window that additionally
  * holds some properties for that window
  *
  * next        - the client after this one, or NULL if the current is the last client
- * isurgent    - set when the window received an urgent hint
- * istransient - set when the window is transient
- * isfullscrn  - set when the window is fullscreen
- * isfloating  - set when the window is floating
+ * prev        - the client before this one, or the last client if this is the head
+ * flags       - the state of the window
+ *               URGENT    - set when the window received an urgent hint
+ *               TRANSIENT - set when the window is transient
+ *               FULLSCRN  - set when the window is fullscreen
+ *               FLOATING  - set when the window is floating
+ *               CLICKGRAB - set when the first button is grabbed on the window for click to focus
+ *               HIDDEN    - set when the window is on a hidden desktop, it is unmapped
+ *                           or with PARK_HIDDEN kept mapped off screen, a parked window
+ *               MAPPING   - set when the window is mapped by arrange() once it is in place
  * win         - the window this client is representing
+ * x, y, w, h  - the geometry last sent to the window, or to be sent if in config,
+ *               x does not include the offset of a parked window
+ * bw          - the border width last sent to the window, or to be sent if in config
+ * bcolor      - the border color last sent to the window
+ * stackpos    - position in the stack order last sent for the desktop, or -1 if unknown
+ * config      - XCB_CONFIG_WINDOW_* mask of the changes not yet sent, see client_configure()
+ * sibling     - the sibling to stack the window relative to, if in config
+ * stackmode   - the stack mode to send, if in config
+ * cfgseq      - sequence of the last ConfigureWindow sent, see xerror()
+ * unmaps      - number of UnmapNotify events the wm's own unmaps will cause, see unmapnotify()
+ * states      - the _NET_WM_STATE atoms the window had when mapped, other than the
+ *               fullscreen and hidden state that the wm manages, see setwmstate()
+ * nstates     - number of those atoms
+ * gen         - generation, counts the times the struct was freed, see handle
  *
- * istransient is separate from isfloating as floating window can be reset
+ * TRANSIENT is separate from FLOATING as floating window can be reset
  * to their tiling positions, while the transients will always be floating
  */
 typedef struct client {
-    struct client *next;
-    bool isurgent, istransient, isfullscrn, isfloating;
-    xcb_window_t win;
+    struct client *next, *prev;
+    xcb_window_t win, sibling;
+    int x, y, w, h, bw, stackpos;
+    unsigned int flags, bcolor, gen, config, stackmode, cfgseq, unmaps, nstates;
+    xcb_atom_t states[WMSTATES];
 } client;
 
+/* a chunk of clients, see client_alloc()
+ * clients never move, and freed ones are reused before a new slab is allocated,
+ * so that the clients are packed together in memory
+ */
+typedef struct slab {
+    struct slab *next;
+    client clients[SLAB];
+} slab;
+
+/* a reference to a client that can tell when the client is freed
+ * c    - the client
+ * gen  - the generation of the client when the handle was taken
+ */
+typedef struct {
+    client *c;
+    unsigned int gen;
+} handle;
+
 /* properties of each desktop
  * master_size  - the size of the master window
  * mode         - the desktop's tiling layout mode
@@ -115,12 +188,15 @@ typedef struct client {
  * current      - the currently highlighted window
  * prevfocus    - the client that previously had focus
  * showpanel    - the visibility status of the panel
+ * pending      - NEED_* flags of the work arrange() has to do on the desktop
+ * count        - the number of clients on the desktop
+ * urgent       - the number of urgent clients on the desktop
  */
 typedef struct {
-    int mode, growth;
-    float master_size;
+    int mode, growth, master_size, count, urgent;
     client *head, *current, *prevfocus;
     bool showpanel;
+    unsigned int pending;
 } desktop;
 
 /* define behavior of certain applications
@@ -135,71 +211,250 @@ typedef struct {
     const bool follow, floating;
 } AppRule;
 
+/* the requests about a created, not yet managed window, see createnotify()
+ * win          - the window, XCB_NONE marks a free entry
+ * wmclass      - the WM_CLASS request
+ * transient    - the WM_TRANSIENT_FOR request
+ * state        - the _NET_WM_STATE request
+ */
+typedef struct {
+    xcb_window_t win;
+    xcb_get_property_cookie_t wmclass, transient, state;
+} prefetch;
+
+/* the requests maprequest_reply() reads the replies of
+ * pf        - the property requests, usually sent on creation
+ * geometry  - the geometry request
+ */
+typedef struct {
+    prefetch pf;
+    xcb_get_geometry_cookie_t geometry;
+} mapreq;
+
+/* a request whose reply is waited for by run(), see pending_add()
+ * sequence - the sequence number of the request
+ * func     - the continuation called with the reply, or NULL on error
+ * win      - the window the request is about, if any
+ * data     - any other state the continuation needs
+ */
+typedef struct {
+    unsigned int sequence;
+    void (*func)(void *reply, xcb_window_t win, void *data);
+    xcb_window_t win;
+    void *data;
+} pending;
+
+/* a file descriptor run() waits on - the X connection, signals, timers
+ * fd       - the file descriptor
+ * func     - called when fd is ready, NULL for the X connection
+ *            which is drained by dispatch() on every iteration of run()
+ */
+typedef struct {
+    int fd;
+    void (*func)(int fd);
+} source;
+
+/* an entry of the window to client index
+ * win      - the window that is looked up, XCB_NONE marks a free slot
+ * c        - the client that holds the window
+ * desktop  - the desktop that the client is on
+ */
+typedef struct {
+    xcb_window_t win;
+    client *c;
+    int desktop;
+} winindex;
+
  /* function prototypes sorted alphabetically */
-static client* addwindow(xcb_window_t w);
+static client* addwindow(xcb_window_t w, desktop *d);
+static void arrange(desktop *d);
+static void attach(client *c, desktop *d, client *before);
 static void buttonpress(xcb_generic_event_t *e);
+static void buttonrelease(xcb_generic_event_t *e);
 static void change_desktop(const Arg *arg);
 static void cleanup(void);
+static client* client_alloc(void);
+static void client_free(client *c);
 static void client_to_desktop(const Arg *arg);
 static void clientmessage(xcb_generic_event_t *e);
+static bool coalesce(xcb_generic_event_t **batch, unsigned int *from, unsigned int n, xcb_generic_event_t *ev);
 static void configurerequest(xcb_generic_event_t *e);
+static void createnotify(xcb_generic_event_t *e);
 static void deletewindow(xcb_window_t w);
 static void desktopinfo(void);
+static void detach(client *c, desktop *d);
+static bool dispatch(void);
+static bool dispatch_blocked(xcb_generic_event_t **batch, unsigned int first, unsigned int i);
 static void destroynotify(xcb_generic_event_t *e);
+static bool drag_move(void);
+static void drag_stop(void);
+static void dragtimer(int fd);
 static void enternotify(xcb_generic_event_t *e);
+static unsigned int eventpriority(xcb_generic_event_t *ev);
+static xcb_window_t eventwindow(xcb_generic_event_t *ev);
+static binding* findbinding(unsigned int code, binding *b);
 static void focusurgent();
-static unsigned int getcolor(char* color);
-static void grabbuttons(client *c);
+static void getcolor(char* color, unsigned int *pixel);
+static void getcolor_reply(void *reply, xcb_window_t win, void *data);
+static void grabbuttons(client *c, unsigned int button);
 static void grabkeys(void);
-static void grid(int h, int y);
+static void grid(int h, int y, desktop *d);
 static void keypress(xcb_generic_event_t *e);
 static void killclient();
+static void killclient_reply(void *reply, xcb_window_t win, void *data);
 static void last_desktop();
+static void mappingnotify(xcb_generic_event_t *e);
 static void maprequest(xcb_generic_event_t *e);
-static void monocle(int h, int y);
+static void maprequest_reply(void *reply, xcb_window_t win, void *data);
+static void monocle(int h, int y, desktop *d);
 static void move_down();
 static void move_up();
+static void motionnotify(xcb_generic_event_t *e);
 static void mousemotion(const Arg *arg);
+static void mousemotion_grab(void *reply, xcb_window_t win, void *data);
+static void mousemotion_pointer(void *reply, xcb_window_t win, void *data);
 static void next_win();
-static client* prev_client();
+static void pending_add(unsigned int sequence, void (*func)(void *, xcb_window_t, void *), xcb_window_t win, void *data);
+static bool pending_run(xcb_generic_event_t *ev);
+static void prefetch_discard(prefetch *p);
+static prefetch* prefetch_find(xcb_window_t w);
+static void prefetch_window(prefetch *p, xcb_atom_t atom);
+static client* prev_client(client *c, desktop *d);
 static void prev_win();
 static void propertynotify(xcb_generic_event_t *e);
+static void propertynotify_reply(void *reply, xcb_window_t win, void *data);
+static bool propertywatched(xcb_atom_t atom);
 static void quit(const Arg *arg);
-static void removeclient(client *c);
+static void readsignal(int fd);
+static void removeclient(client *c, desktop *d);
 static void resize_master(const Arg *arg);
+static void restack(client **s, int n);
 static void resize_stack(const Arg *arg);
 static void rotate(const Arg *arg);
 static void rotate_filled(const Arg *arg);
 static void run(void);
-static void save_desktop(int i);
-static void select_desktop(int i);
 static void fullscreen_toggle();
-static void setfullscreen(client *c, bool fullscrn);
+static void setfullscreen(client *c, desktop *d, bool fullscrn);
+static void setwmstate(client *c);
 static int setup(int default_screen);
-static void sigchld();
+static void setup_keyboard(void);
+static void setup_keyboard_reply(void *reply, xcb_window_t win, void *data);
+static source* source_add(int fd, unsigned int events, void (*func)(int fd));
+static void source_watch(source *s, unsigned int events);
 static void spawn(const Arg *arg);
-static void stack(int h, int y);
+static void status_write(int fd);
+static void stack(int h, int y, desktop *d);
 static void swap_master();
 static void switch_mode(const Arg *arg);
-static void tile(void);
+static void tile(desktop *d);
 static void togglepanel();
-static void update_current(client *c);
+static void update_current(client *c, desktop *d);
 static void unmapnotify(xcb_generic_event_t *e);
-static client* wintoclient(xcb_window_t w);
+static void winindex_add(client *c, int desktop);
+static void winindex_del(xcb_window_t w);
+static winindex* winindex_find(xcb_window_t w);
+static bool wintoclient(xcb_window_t w, client **c, desktop **d);
+static void xerror(xcb_generic_event_t *e);
 
 #include "config.h"
 
+#if DESKTOPS > 32
+#  error "DESKTOPS can be at most 32, the urgent desktops are kept as bits of an unsigned int"
+#endif
+
 /* variables */
-static bool running = true, showpanel = SHOW_PANEL;
+static bool running = true;
 static int previous_desktop = 0, current_desktop = 0, retval = 0;
-static int wh, ww, mode = DEFAULT_MODE, master_size = 0, growth = 0;
+static int wh, ww;
 static unsigned int numlockmask = 0, win_unfocus, win_focus;
 static xcb_connection_t *dis;
 static xcb_screen_t *screen;
-static client *head, *prevfocus, *current;
+static xcb_key_symbols_t *keysyms;
 
 static xcb_atom_t wmatoms[WM_COUNT], netatoms[NET_COUNT];
 static desktop desktops[DESKTOPS];
+static unsigned int urgentmask = 0; /* bit n is set when desktop n has an urgent client */
+
+/* the tiled clients of the desktop being arranged, in list order. collected
+ * once per layout pass by arrange(), so the layouts scan a packed array */
+static client **tiled = NULL;
+static unsigned int ntiled = 0, tiledsize = 0;
+
+/* the slabs clients are allocated from, and the list of free clients linked by next */
+static slab *slabs = NULL;
+static client *freeclients = NULL;
+
+/* window to client index - an open addressing hash table with linear probing
+ * so that event handlers can find a window's client without walking desktops
+ * winsize is always a power of two and is kept at least twice wincount,
+ * winshift is 32 less its log2, see winindex_hash() */
+static winindex *wintable = NULL;
+static unsigned int winsize = 0, winshift = 32, wincount = 0;
+
+/* dispatch table of the keys and buttons - an open addressing hash table
+ * rebuilt whenever the keys are grabbed, as keycodes and numlock may change.
+ * bindsize is a power of two and at least twice the number of bindings,
+ * bindshift is 32 less its log2, see bindhash() */
+static binding *bindtable = NULL;
+static unsigned int bindsize = 0, bindshift = 32;
+
+/* the requests whose replies are waited for - a ring buffer in request order.
+ * replies arrive in that order, so only the oldest request is ever polled.
+ * pendsize is always a power of two */
+static pending *pendtable = NULL;
+static unsigned int pendsize = 0, pendfirst = 0, pendcount = 0;
+
+/* the window moved or resized with the pointer, see mousemotion()
+ * win      - the dragged window, XCB_NONE when nothing is dragged
+ * c        - the dragged client, once the pointer is grabbed
+ * active   - set once the pointer is grabbed
+ * timed    - set while the window isn't moved again, see drag_move()
+ * moved    - set when the pointer moved while timed
+ * mode     - whether the window is moved or resized
+ * mx, my   - the pointer position when the drag started
+ * px, py   - the last pointer position
+ * x,y,w,h  - the window geometry when the drag started */
+static struct {
+    xcb_window_t win;
+    handle c;
+    bool active, timed, moved;
+    int mode, mx, my, px, py, x, y, w, h;
+} drag;
+
+/* how many events were read, how many of them were coalesced by kind
+ * and how many property notifications were ignored, see coalesce().
+ * how many status lines were suppressed as unchanged or dropped as stale,
+ * see desktopinfo(). printed on standard error on SIGUSR2 */
+static struct {
+    unsigned long events, motion, enter, property, configure, ignored, suppressed, dropped;
+} stats;
+
+/* the nsources file descriptors run() waits on
+ * epfd is the epoll instance, sigfd receives the signals the wm handles
+ * and dragfd times the moves of a dragged window */
+static source sources[SOURCES];
+static unsigned int nsources = 0;
+static int epfd = -1, sigfd = -1, dragfd = -1;
+
+/* the status line written on standard output, see desktopinfo()
+ * line     - the latest line, written or being written
+ * next     - a newer line, to write once line is written
+ * len, off - the length of line and how much of it is written
+ * hasnext  - set when next holds a line
+ * closed   - set when standard output can't be written anymore
+ * src      - the source waiting for standard output to be writable,
+ *            NULL if it can't be waited on, like a regular file */
+static struct {
+    char line[DESKTOPS * 64], next[DESKTOPS * 64];
+    size_t len, off;
+    bool hasnext, closed;
+    source *src;
+} status;
+
+/* the windows whose properties were requested on creation
+ * when all entries are taken, the oldest is evicted round robin */
+static prefetch prefetched[PREFETCH];
+static unsigned int prefetch_evict = 0;
 
 /* events array
  * on receival of a new event, call the appropriate function to handle it
@@ -208,8 +463,9 @@ static void (*events[XCB_NO_OPERATION])(xcb_generic_event_t *e);
 
 /* layout array - given the current layout mode, tile the windows
  * h (or hh) - avaible height that windows have to expand
- * y (or cy) - offset from top to place the windows (reserved by the panel) */
-static void (*layout[MODES])(int h, int y) = {
+ * y (or cy) - offset from top to place the windows (reserved by the panel)
+ * d         - the desktop whose windows are arranged */
+static void (*layout[MODES])(int h, int y, desktop *d) = {
     [TILE] = stack, [BSTACK] = stack, [GRID] = grid, [MONOCLE] = monocle,
 };
 
@@ -221,58 +477,105 @@ static xcb_screen_t *xcb_screen_of_display(xcb_connection_t *con, int screen) {
     return NULL;
 }
 
-/* wrapper to move and resize window */
-static inline void xcb_move_resize(xcb_connection_t *con, xcb_window_t win, int x, int y, int w, int h) {
-    unsigned int pos[4] = { x, y, w, h };
-    xcb_configure_window(con, win, XCB_MOVE_RESIZE, pos);
+/* move and resize the client's window, unless it already has that geometry
+ * the change is only sent by client_configure() */
+static inline void client_move_resize(client *c, int x, int y, int w, int h) {
+    if (c->x == x && c->y == y && c->w == w && c->h == h) return;
+    c->x = x; c->y = y; c->w = w; c->h = h;
+    c->config |= XCB_MOVE_RESIZE;
+}
+
+/* set the client's border width, unless it already has that width
+ * the change is only sent by client_configure() */
+static inline void client_border_width(client *c, int bw) {
+    if (c->bw == bw) return;
+    c->bw = bw;
+    c->config |= XCB_CONFIG_WINDOW_BORDER_WIDTH;
 }
 
-/* wrapper to move window */
-static inline void xcb_move(xcb_connection_t *con, xcb_window_t win, int x, int y) {
-    unsigned int pos[2] = { x, y };
-    xcb_configure_window(con, win, XCB_MOVE, pos);
+/* stack the client's window above or below the sibling, or on top or
+ * bottom of all windows if it is XCB_NONE. only sent by client_configure() */
+static inline void client_stack(client *c, xcb_window_t sibling, unsigned int mode) {
+    c->sibling = sibling; c->stackmode = mode;
+    c->config = (c->config & ~XCB_CONFIG_WINDOW_SIBLING) | XCB_CONFIG_WINDOW_STACK_MODE
+              | (sibling != XCB_NONE ? XCB_CONFIG_WINDOW_SIBLING:0);
 }
 
-/* wrapper to resize window */
-static inline void xcb_resize(xcb_connection_t *con, xcb_window_t win, int w, int h) {
-    unsigned int pos[2] = { w, h };
-    xcb_configure_window(con, win, XCB_RESIZE, pos);
+/* unmap the client's window, counting the UnmapNotify it causes so that
+ * unmapnotify() tells it apart from the client withdrawing the window.
+ * the window must be mapped, else no event comes to count down */
+static inline void client_unmap(client *c) {
+    if (c->flags & MAPPING) { c->flags &= ~MAPPING; return; } /* not mapped yet */
+    c->unmaps++;
+    xcb_unmap_window(dis, c->win);
 }
 
-/* wrapper to raise window */
-static inline void xcb_raise_window(xcb_connection_t *con, xcb_window_t win) {
-    unsigned int arg[1] = { XCB_STACK_MODE_ABOVE };
-    xcb_configure_window(con, win, XCB_CONFIG_WINDOW_STACK_MODE, arg);
+/* mark the client's window hidden or shown and set its state to match, so
+ * the client can stop drawing. the caller unmaps or maps the window, or with
+ * PARK_HIDDEN it is moved off screen or back, sent by client_configure() */
+static inline void client_hide(client *c, bool hide) {
+    if (!(c->flags & HIDDEN) == !hide) return;
+    c->flags ^= HIDDEN;
+    if (PARK_HIDDEN) c->config |= XCB_CONFIG_WINDOW_X;
+    setwmstate(c);
 }
 
-/* wrapper to set xcb border width */
-static inline void xcb_border_width(xcb_connection_t *con, xcb_window_t win, int w) {
-    unsigned int arg[1] = { w };
-    xcb_configure_window(con, win, XCB_CONFIG_WINDOW_BORDER_WIDTH, arg);
+/* send the geometry, border width and stacking changes gathered
+ * for the client's window in a single request */
+static inline void client_configure(client *c) {
+    unsigned int v[7], i = 0;
+    if (!c->config) return;
+    if (c->config & XCB_CONFIG_WINDOW_X)            v[i++] = c->x + PARKX(c);
+    if (c->config & XCB_CONFIG_WINDOW_Y)            v[i++] = c->y;
+    if (c->config & XCB_CONFIG_WINDOW_WIDTH)        v[i++] = c->w;
+    if (c->config & XCB_CONFIG_WINDOW_HEIGHT)       v[i++] = c->h;
+    if (c->config & XCB_CONFIG_WINDOW_BORDER_WIDTH) v[i++] = c->bw;
+    if (c->config & XCB_CONFIG_WINDOW_SIBLING)      v[i++] = c->sibling;
+    if (c->config & XCB_CONFIG_WINDOW_STACK_MODE)   v[i++] = c->stackmode;
+    c->cfgseq = xcb_configure_window(dis, c->win, c->config, v).sequence;
+    c->config = 0;
 }
 
-/* wrapper to get xcb keysymbol from keycode */
-static xcb_keysym_t xcb_get_keysym(xcb_keycode_t keycode) {
-    xcb_key_symbols_t *keysyms;
-    xcb_keysym_t       keysym;
+/* set the client's border color, unless it already has that color */
+static inline void client_border_color(client *c, unsigned int color) {
+    if (c->bcolor == color) return;
+    c->bcolor = color;
+    xcb_change_window_attributes(dis, c->win, XCB_CW_BORDER_PIXEL, &c->bcolor);
+}
 
-    if (!(keysyms = xcb_key_symbols_alloc(dis))) return 0;
-    keysym = xcb_key_symbols_get_keysym(keysyms, keycode, 0);
-    xcb_key_symbols_free(keysyms);
+/* take a handle to the client */
+static inline handle client_handle(client *c) {
+    return (handle){ .c = c, .gen = c ? c->gen:0 };
+}
 
-    return keysym;
+/* get the client of the handle, or NULL if it was freed since */
+static inline client* handle_client(handle h) {
+    return h.c && h.c->gen == h.gen ? h.c:NULL;
 }
 
-/* wrapper to get xcb keycodes from keysymbol */
-static xcb_keycode_t* xcb_get_keycodes(xcb_keysym_t keysym) {
-    xcb_key_symbols_t *keysyms;
-    xcb_keycode_t     *keycode;
+/* set whether the client on the given desktop is urgent
+ * and keep the desktop's urgent count and the urgent mask along */
+static void client_urgent(client *c, desktop *d, bool urgent) {
+    if (!(c->flags & URGENT) == !urgent) return;
+    c->flags ^= URGENT;
+    d->urgent += urgent ? 1:-1;
+    if (d->urgent) urgentmask |= 1u << (d - desktops); else urgentmask &= ~(1u << (d - desktops));
+}
 
-    if (!(keysyms = xcb_key_symbols_alloc(dis))) return NULL;
-    keycode = xcb_key_symbols_get_keycode(keysyms, keysym);
-    xcb_key_symbols_free(keysyms);
+/* grab the first button on the client so that a click focuses it,
+ * or release it and grab the bindings of the first button again, unless it already is */
+static void client_grab_click(client *c, bool grab) {
+    if (!(c->flags & CLICKGRAB) == !grab) return;
+    c->flags ^= CLICKGRAB;
+    if (grab) xcb_grab_button(dis, 1, c->win, XCB_EVENT_MASK_BUTTON_PRESS, XCB_GRAB_MODE_ASYNC, XCB_GRAB_MODE_ASYNC,
+                                               screen->root, XCB_NONE, XCB_BUTTON_INDEX_1, XCB_BUTTON_MASK_ANY);
+    else { xcb_ungrab_button(dis, XCB_BUTTON_INDEX_1, c->win, XCB_BUTTON_MASK_ANY); grabbuttons(c, XCB_BUTTON_INDEX_1); }
+}
 
-    return keycode;
+/* wrapper to get xcb keycodes from keysymbol
+ * the returned XCB_NO_SYMBOL terminated array must be freed */
+static inline xcb_keycode_t* xcb_get_keycodes(xcb_keysym_t keysym) {
+    return xcb_key_symbols_get_keycode(keysyms, keysym);
 }
 
 /* retieve RGB color from hex (think of html) */
@@ -282,26 +585,17 @@ static unsigned int xcb_get_colorpixel(char *hex) {
     return (rgb16[0] << 16) + (rgb16[1] << 8) + rgb16[2];
 }
 
-/* wrapper to get atoms using xcb */
-static void xcb_get_atoms(char **names, xcb_atom_t *atoms, unsigned int count) {
-    xcb_intern_atom_cookie_t cookies[count];
-    xcb_intern_atom_reply_t  *reply;
-
-    for (unsigned int i = 0; i < count; i++) cookies[i] = xcb_intern_atom(dis, 0, strlen(names[i]), names[i]);
-    for (unsigned int i = 0; i < count; i++) {
-        reply = xcb_intern_atom_reply(dis, cookies[i], NULL); /* TODO: Handle error */
-        if (reply) {
-            DEBUGP("%s : %d\n", names[i], reply->atom);
-            atoms[i] = reply->atom; free(reply);
-        } else puts("WARN: monsterwm failed to register %s atom.\nThings might not work right.");
-    }
+/* store an interned atom, data points to where it's kept */
+static void getatom_reply(void *reply, xcb_window_t win, void *data) {
+    (void)win;
+    if (reply) *(xcb_atom_t*)data = ((xcb_intern_atom_reply_t*)reply)->atom;
+    else fputs("WARN: monsterwm failed to register an atom.\nThings might not work right.\n", stderr);
 }
 
-/* wrapper to window get attributes using xcb */
-static void xcb_get_attributes(xcb_window_t *windows, xcb_get_window_attributes_reply_t **reply, unsigned int count) {
-    xcb_get_window_attributes_cookie_t cookies[count];
-    for (unsigned int i = 0; i < count; i++) cookies[i] = xcb_get_window_attributes(dis, windows[i]);
-    for (unsigned int i = 0; i < count; i++) reply[i]   = xcb_get_window_attributes_reply(dis, cookies[i], NULL); /* TODO: Handle error */
+/* wrapper to get atoms using xcb, the atoms are set as the replies arrive */
+static void xcb_get_atoms(char **names, xcb_atom_t *atoms, unsigned int count) {
+    for (unsigned int i = 0; i < count; i++)
+        pending_add(xcb_intern_atom(dis, 0, strlen(names[i]), names[i]).sequence, getatom_reply, XCB_NONE, &atoms[i]);
 }
 
 /* check if other wm exists */
@@ -318,34 +612,127 @@ static int xcb_checkotherwm(void) {
 /* create a new client and add the new window
  * window should notify of property change events
  */
-client* addwindow(xcb_window_t w) {
-    client *c, *t = prev_client(head);
-    if (!(c = (client *)calloc(1, sizeof(client)))) err(EXIT_FAILURE, "cannot allocate client");
+client* addwindow(xcb_window_t w, desktop *d) {
+    client *c;
+    c = client_alloc();
 
-    if (!head) head = c;
-    else if (!ATTACH_ASIDE) { c->next = head; head = c; }
-    else if (t) t->next = c; else head->next = c;
+    attach(c, d, ATTACH_ASIDE ? NULL:d->head);
 
+    c->bw = -1; c->bcolor = ~0u; /* unknown until they are sent or queried */
+    c->stackpos = -1;
+    d->count++;
     unsigned int values[1] = { XCB_EVENT_MASK_PROPERTY_CHANGE|(FOLLOW_MOUSE?XCB_EVENT_MASK_ENTER_WINDOW:0) };
     xcb_change_window_attributes_checked(dis, (c->win = w), XCB_CW_EVENT_MASK, values);
+    winindex_add(c, d - desktops);
     return c;
 }
 
+/* do the work scheduled on the desktop by tile() and update_current()
+ *
+ * handlers only mark what has to change, once all queued events are
+ * handled run() calls this, so a burst of events is applied only once.
+ * first the windows are tiled, then focus is applied - borders are
+ * highlighted, windows restacked and the active window set. the geometry,
+ * border and stacking changes are gathered per window and sent after, one
+ * request for each window, bottom to top in the new stack order, so every
+ * window is stacked after the sibling it is stacked relative to. a new
+ * window is mapped right after its configure, and the input focus is set
+ * last, once the focused window is mapped.
+ *
+ * hidden desktops are arranged too while their windows are unmapped, so
+ * showing one only has to map its windows. the active window and input
+ * focus are only set for the current desktop.
+ *
+ * stack order by client properties, top to bottom:
+ *  - current when floating or transient
+ *  - floating or trancient windows
+ *  - current when tiled
+ *  - current when fullscreen
+ *  - fullscreen windows
+ *  - tiled windows
+ *
+ * a window should have borders in any case, except if
+ *  - the window is the only window on screen
+ *  - the window is fullscreen
+ *  - the mode is MONOCLE and the window is not floating or transient */
+void arrange(desktop *d) {
+    client *c, *w[d->count + 1];
+    int n = 0, k = 0;
+    bool shown = d == &desktops[current_desktop];
+    if (d->pending & NEED_TILE && d->head) {
+        if ((unsigned int)d->count > tiledsize && !(tiled = realloc(tiled, (tiledsize = 2 * d->count) * sizeof(client*))))
+            err(EXIT_FAILURE, "cannot allocate tiled clients");
+        for (c = d->head, ntiled = 0; c; c = c->next) if (!ISFFT(c)) tiled[ntiled++] = c;
+        layout[d->head->next ? d->mode : MONOCLE](wh + (d->showpanel ? 0:PANEL_HEIGHT),
+                                    (TOP_PANEL && d->showpanel ? PANEL_HEIGHT:0), d);
+    }
+    if (d->pending & NEED_FOCUS && d->current) {
+        /* num of n:all windows - ft:current is floating or transient */
+        bool ft = d->current->flags & (FLOATING|TRANSIENT);
+        for (c = d->head; c; c = c->next, ++n) {
+            client_border_color(c, c == d->current ? win_focus:win_unfocus);
+            client_border_width(c, (!d->head->next || c->flags & FULLSCRN
+                        || (d->mode == MONOCLE && !ISFFT(c))) ? 0:BORDER_WIDTH);
+            if (CLICK_TO_FOCUS) client_grab_click(c, c != d->current);
+        }
+
+        /* restack - collect the windows in stack order, bottom to top */
+        for (c = d->head; c; c = c->next) if (c != d->current && !ISFFT(c)) w[k++] = c;
+        for (c = d->head; c; c = c->next) if (c != d->current && c->flags & FULLSCRN) w[k++] = c;
+        if (!ft) w[k++] = d->current;
+        for (c = d->head; c; c = c->next) if (c != d->current && ISFFT(c) && !(c->flags & FULLSCRN)) w[k++] = c;
+        if (ft) w[k++] = d->current;
+        restack(w, n);
+    }
+
+    /* send the gathered changes, and map new windows once they are in place */
+    if (!n && d->pending) for (c = d->head; c; c = c->next) w[n++] = c;
+    for (k = 0; k < n; k++) {
+        client_configure(w[k]);
+        if (w[k]->flags & MAPPING) { w[k]->flags &= ~MAPPING; xcb_map_window(dis, w[k]->win); }
+    }
+
+    if (shown && d->pending & NEED_FOCUS && d->current) {
+        xcb_change_property(dis, XCB_PROP_MODE_REPLACE, screen->root, netatoms[NET_ACTIVE], XCB_ATOM_WINDOW, 32, 1, &d->current->win);
+        xcb_set_input_focus(dis, XCB_INPUT_FOCUS_POINTER_ROOT, d->current->win, XCB_CURRENT_TIME);
+    } else if (shown && d->pending & NEED_FOCUS) {
+        xcb_delete_property(dis, screen->root, netatoms[NET_ACTIVE]);
+        /* a parked window is still viewable and would keep the focus */
+        if (PARK_HIDDEN) xcb_set_input_focus(dis, XCB_INPUT_FOCUS_POINTER_ROOT, screen->root, XCB_CURRENT_TIME);
+    }
+    d->pending = 0;
+}
+
+/* link the client into the desktop's client list before the given client,
+ * or as the last client if before is NULL */
+void attach(client *c, desktop *d, client *before) {
+    if (!d->head) { c->next = NULL; d->head = c->prev = c; return; }
+    if (!before) { c->next = NULL; c->prev = d->head->prev; c->prev->next = c; d->head->prev = c; return; }
+    c->next = before; c->prev = before->prev;
+    if (before == d->head) d->head = c; else before->prev->next = c;
+    before->prev = c;
+}
+
 /* on the press of a button check to see if there's a binded function to call */
 void buttonpress(xcb_generic_event_t *e) {
     xcb_button_press_event_t *ev = (xcb_button_press_event_t*)e;
     DEBUGP("xcb: button press: %d state: %d\n", ev->detail, ev->state);
 
-    client *c = wintoclient(ev->event);
-    if (!c) return;
-    if (CLICK_TO_FOCUS && current != c && ev->detail == XCB_BUTTON_INDEX_1) update_current(c);
+    client *c = NULL; desktop *d = NULL;
+    if (drag.active) { drag_stop(); return; }
+    if (!wintoclient(ev->event, &c, &d)) return;
+    if (CLICK_TO_FOCUS && d->current != c && ev->detail == XCB_BUTTON_INDEX_1) update_current(c, d);
 
-    for (unsigned int i=0; i<LENGTH(buttons); i++)
-        if (buttons[i].func && buttons[i].button == ev->detail &&
-            CLEANMASK(buttons[i].mask) == CLEANMASK(ev->state)) {
-            if (current != c) update_current(c);
-            buttons[i].func(&(buttons[i].arg));
-        }
+    for (binding *b = NULL; (b = findbinding(BINDCODE(1u, ev->detail, ev->state), b));) {
+        if (d->current != c) update_current(c, d);
+        b->func(b->arg);
+    }
+}
+
+/* releasing a button ends moving or resizing a window */
+void buttonrelease(xcb_generic_event_t *e) {
+    (void)e;
+    if (drag.active) drag_stop();
 }
 
 /* focus another desktop
@@ -357,15 +744,20 @@ void buttonpress(xcb_generic_event_t *e) {
  * first all others then the current */
 void change_desktop(const Arg *arg) {
     if (arg->i == current_desktop) return;
-    previous_desktop = current_desktop;
-    select_desktop(arg->i);
-    if (current) xcb_map_window(dis, current->win);
-    for (client *c=head; c; c=c->next) xcb_map_window(dis, c->win);
-    select_desktop(previous_desktop);
-    for (client *c=head; c; c=c->next) if (c != current) xcb_unmap_window(dis, c->win);
-    if (current) xcb_unmap_window(dis, current->win);
-    select_desktop(arg->i);
-    tile(); update_current(current);
+    desktop *d = &desktops[current_desktop], *n = &desktops[arg->i];
+    for (client *c=n->head; c; c=c->next) client_hide(c, false);
+    arrange(n); /* apply what is left while its windows are still unmapped or parked */
+    /* bring the new desktop in before the old one is parked, so the root never shows in between */
+    if (PARK_HIDDEN) for (client *c=n->head; c; c=c->next) client_configure(c);
+    for (client *c=d->head; c; c=c->next) { client_hide(c, true); if (PARK_HIDDEN) client_configure(c); }
+    previous_desktop = current_desktop; current_desktop = arg->i;
+    if (!PARK_HIDDEN) {
+        if (n->current) xcb_map_window(dis, n->current->win);
+        for (client *c=n->head; c; c=c->next) xcb_map_window(dis, c->win);
+        for (client *c=d->head; c; c=c->next) if (c != d->current) client_unmap(c);
+        if (d->current) client_unmap(d->current);
+    }
+    update_current(n->current, n);
     desktopinfo();
 }
 
@@ -375,6 +767,15 @@ void cleanup(void) {
     xcb_window_t *c;
 
     xcb_ungrab_key(dis, XCB_GRAB_ANY, screen->root, XCB_MOD_MASK_ANY);
+    if (keysyms) xcb_key_symbols_free(keysyms);
+    free(bindtable);
+    free(wintable);
+    free(pendtable);
+    free(tiled);
+    for (slab *s; (s = slabs); free(s)) slabs = s->next;
+    if (dragfd != -1) close(dragfd);
+    if (sigfd != -1) close(sigfd);
+    if (epfd != -1) close(epfd);
     if ((query = xcb_query_tree_reply(dis,xcb_query_tree(dis,screen->root),0))) {
         c = xcb_query_tree_children(query);
         for (unsigned int i = 0; i != query->children_len; ++i) deletewindow(c[i]);
@@ -383,26 +784,47 @@ void cleanup(void) {
     xcb_set_input_focus(dis, XCB_INPUT_FOCUS_POINTER_ROOT, screen->root, XCB_CURRENT_TIME);
 }
 
+/* get a zeroed client from the free list, allocating a new slab if it's empty */
+client* client_alloc(void) {
+    client *c;
+    if (!freeclients) {
+        slab *s;
+        if (!(s = calloc(1, sizeof(slab)))) err(EXIT_FAILURE, "cannot allocate client");
+        s->next = slabs; slabs = s;
+        for (int i = SLAB - 1; i >= 0; i--) { s->clients[i].next = freeclients; freeclients = &s->clients[i]; }
+    }
+    freeclients = (c = freeclients)->next;
+    *c = (client){ .gen = c->gen };
+    return c;
+}
+
+/* put the client back on the free list, any handle to it becomes stale */
+void client_free(client *c) {
+    c->gen++;
+    c->next = freeclients; freeclients = c;
+}
+
 /* move a client to another desktop
  *
  * remove the current client from the current desktop's client list
  * and add it as last client of the new desktop's client list */
 void client_to_desktop(const Arg *arg) {
-    if (!current || arg->i == current_desktop) return;
-    int cd = current_desktop;
-    client *p = prev_client(current), *c = current;
-
-    select_desktop(arg->i);
-    client *l = prev_client(head);
-    update_current(l ? (l->next = c):head ? (head->next = c):(head = c));
-
-    select_desktop(cd);
-    if (c == head || !p) head = c->next; else p->next = c->next;
-    c->next = NULL;
-    xcb_unmap_window(dis, c->win);
-    update_current(prevfocus);
-
-    if (FOLLOW_WINDOW) change_desktop(arg); else tile();
+    desktop *d = &desktops[current_desktop], *n = &desktops[arg->i];
+    if (!d->current || arg->i == current_desktop) return;
+    client *c = d->current;
+
+    detach(c, d); attach(c, n, NULL);
+    c->stackpos = -1;
+    d->count--; n->count++;
+    bool urgent = c->flags & URGENT;
+    client_urgent(c, d, false); client_urgent(c, n, urgent);
+    tile(n); update_current(c, n);
+    winindex_add(c, arg->i);
+    client_hide(c, true);
+    if (PARK_HIDDEN) client_configure(c); else client_unmap(c);
+    update_current(d->prevfocus, d);
+
+    if (FOLLOW_WINDOW) change_desktop(arg); else tile(d);
     desktopinfo();
 }
 
@@ -418,14 +840,76 @@ void client_to_desktop(const Arg *arg) {
  * check if window requested fullscreen or activation */
 void clientmessage(xcb_generic_event_t *e) {
     xcb_client_message_event_t *ev = (xcb_client_message_event_t*)e;
-    client *t = NULL, *c = wintoclient(ev->window);
-    if (c && ev->type                      == netatoms[NET_WM_STATE]
+    client *c = NULL; desktop *d = NULL;
+    if (!wintoclient(ev->window, &c, &d)) return;
+    if (ev->type                           == netatoms[NET_WM_STATE]
           && ((unsigned)ev->data.data32[1] == netatoms[NET_FULLSCREEN]
           ||  (unsigned)ev->data.data32[2] == netatoms[NET_FULLSCREEN]))
-        setfullscreen(c, (ev->data.data32[0] == 1 || (ev->data.data32[0] == 2 && !c->isfullscrn)));
-    else if (c && ev->type == netatoms[NET_ACTIVE]) for (t=head; t && t!=c; t=t->next);
-    if (t) update_current(c);
-    tile();
+        setfullscreen(c, d, (ev->data.data32[0] == 1 || (ev->data.data32[0] == 2 && !(c->flags & FULLSCRN))));
+    else if (ev->type == netatoms[NET_ACTIVE] && d == &desktops[current_desktop]) update_current(c, d);
+    tile(&desktops[current_desktop]);
+}
+
+/* drop the events of the batch the new event ev makes redundant
+ *
+ * only the events since the last barrier, batch[*from..n), are looked at.
+ * input and structural events are barriers, as events before them must
+ * be handled before them. of the rest
+ *  - only the last pointer motion matters to a drag
+ *  - only the last enter that can change the focus matters
+ *  - a property notify only tells to read the property again, once is enough,
+ *    and not at all if the property is not watched
+ *  - a configure request is merged into the later one of the same window,
+ *    whose values take precedence
+ * the earlier events are dropped, returns false if ev itself is dropped */
+bool coalesce(xcb_generic_event_t **batch, unsigned int *from, unsigned int n, xcb_generic_event_t *ev) {
+    unsigned int type = ev->response_type & ~0x80, i;
+    xcb_generic_event_t *p = NULL;
+    if (type == XCB_PROPERTY_NOTIFY && !propertywatched(((xcb_property_notify_event_t*)ev)->atom)) { ++stats.ignored; return false; }
+    for (i = *from; i < n && !p; i++) {
+        if (!batch[i] || (batch[i]->response_type & ~0x80) != type) continue;
+        switch (type) {
+            case XCB_MOTION_NOTIFY: case XCB_ENTER_NOTIFY: p = batch[i]; break;
+            case XCB_PROPERTY_NOTIFY:
+                if (((xcb_property_notify_event_t*)batch[i])->window == ((xcb_property_notify_event_t*)ev)->window
+                 && ((xcb_property_notify_event_t*)batch[i])->atom   == ((xcb_property_notify_event_t*)ev)->atom) p = batch[i];
+                break;
+            case XCB_CONFIGURE_REQUEST:
+                if (((xcb_configure_request_event_t*)batch[i])->window == ((xcb_configure_request_event_t*)ev)->window) p = batch[i];
+                break;
+        }
+    }
+
+    switch (type) {
+        case XCB_MOTION_NOTIFY:   stats.motion   += p != NULL; break;
+        case XCB_PROPERTY_NOTIFY: stats.property += p != NULL; break;
+        case XCB_ENTER_NOTIFY:
+            if (((xcb_enter_notify_event_t*)ev)->mode != XCB_NOTIFY_MODE_NORMAL
+             || ((xcb_enter_notify_event_t*)ev)->detail == XCB_NOTIFY_DETAIL_INFERIOR) { ++stats.enter; return false; }
+            stats.enter += p != NULL;
+            break;
+        case XCB_CONFIGURE_REQUEST:
+            if (!p) break;
+            ++stats.configure;
+            xcb_configure_request_event_t *a = (xcb_configure_request_event_t*)p, *b = (xcb_configure_request_event_t*)ev;
+            uint16_t m = a->value_mask & ~b->value_mask;
+            if (m & XCB_CONFIG_WINDOW_X)            b->x = a->x;
+            if (m & XCB_CONFIG_WINDOW_Y)            b->y = a->y;
+            if (m & XCB_CONFIG_WINDOW_WIDTH)        b->width = a->width;
+            if (m & XCB_CONFIG_WINDOW_HEIGHT)       b->height = a->height;
+            if (m & XCB_CONFIG_WINDOW_BORDER_WIDTH) b->border_width = a->border_width;
+            if (m & XCB_CONFIG_WINDOW_STACK_MODE) { b->sibling = a->sibling; b->stack_mode = a->stack_mode; }
+            else m &= ~XCB_CONFIG_WINDOW_SIBLING;
+            b->value_mask |= m;
+            break;
+        case XCB_KEY_PRESS: case XCB_KEY_RELEASE: case XCB_BUTTON_PRESS: case XCB_BUTTON_RELEASE:
+        case XCB_CREATE_NOTIFY: case XCB_DESTROY_NOTIFY: case XCB_UNMAP_NOTIFY: case XCB_MAP_REQUEST:
+        case XCB_CLIENT_MESSAGE: case XCB_MAPPING_NOTIFY:
+            *from = n + 1;
+            break;
+    }
+    if (p) { batch[--i] = NULL; free(p); }
+    return true;
 }
 
 /* a configure request means that the window requested changes in its geometry
@@ -435,21 +919,59 @@ void clientmessage(xcb_generic_event_t *e) {
  */
 void configurerequest(xcb_generic_event_t *e) {
     xcb_configure_request_event_t *ev = (xcb_configure_request_event_t*)e;
-    client *c = wintoclient(ev->window);
-    if (c && c->isfullscrn) setfullscreen(c, true);
-    else {
+    desktop *d = &desktops[current_desktop], *cd = NULL;
+    client *c = NULL;
+    if (wintoclient(ev->window, &c, &cd) && c->flags & FULLSCRN) {
+        /* the request is refused, the window still has to be told its geometry */
+        setfullscreen(c, cd, true);
+        c->config |= XCB_MOVE_RESIZE;
+    } else {
         unsigned int v[7];
         unsigned int i = 0;
-        if (ev->value_mask & XCB_CONFIG_WINDOW_X)              v[i++] = ev->x;
-        if (ev->value_mask & XCB_CONFIG_WINDOW_Y)              v[i++] = ev->y + (showpanel && TOP_PANEL) ? PANEL_HEIGHT : 0;
+        if (ev->value_mask & XCB_CONFIG_WINDOW_X)              v[i++] = ev->x + (c ? PARKX(c):0);
+        if (ev->value_mask & XCB_CONFIG_WINDOW_Y)              v[i++] = ev->y + (d->showpanel && TOP_PANEL) ? PANEL_HEIGHT : 0;
         if (ev->value_mask & XCB_CONFIG_WINDOW_WIDTH)          v[i++] = (ev->width  < ww - BORDER_WIDTH) ? ev->width  : ww + BORDER_WIDTH;
         if (ev->value_mask & XCB_CONFIG_WINDOW_HEIGHT)         v[i++] = (ev->height < wh - BORDER_WIDTH) ? ev->height : wh + BORDER_WIDTH;
         if (ev->value_mask & XCB_CONFIG_WINDOW_BORDER_WIDTH)   v[i++] = ev->border_width;
         if (ev->value_mask & XCB_CONFIG_WINDOW_SIBLING)        v[i++] = ev->sibling;
         if (ev->value_mask & XCB_CONFIG_WINDOW_STACK_MODE)     v[i++] = ev->stack_mode;
         xcb_configure_window(dis, ev->window, ev->value_mask, v);
+
+        /* keep the geometry cache of the client in sync with what was sent,
+         * so tiling sends the window back into place if it has to */
+        if (c) {
+            i = 0; c->config &= ~(ev->value_mask & (XCB_MOVE_RESIZE|XCB_CONFIG_WINDOW_BORDER_WIDTH));
+            if (ev->value_mask & XCB_CONFIG_WINDOW_X)            c->x  = v[i++] - PARKX(c);
+            if (ev->value_mask & XCB_CONFIG_WINDOW_Y)            c->y  = v[i++];
+            if (ev->value_mask & XCB_CONFIG_WINDOW_WIDTH)        c->w  = v[i++];
+            if (ev->value_mask & XCB_CONFIG_WINDOW_HEIGHT)       c->h  = v[i++];
+            if (ev->value_mask & XCB_CONFIG_WINDOW_BORDER_WIDTH) c->bw = v[i++];
+            if (ev->value_mask & XCB_CONFIG_WINDOW_STACK_MODE)   c->stackpos = -1;
+        }
     }
-    tile();
+    tile(c ? cd : d); /* a hidden client's own desktop is the one to put it back in place */
+}
+
+/* a create notification is received when a window is created
+ *
+ * clients usually map a window right after creating it, so request the
+ * properties maprequest() needs now, and their replies will mostly be in
+ * by the time the window is mapped. the window is made to report property
+ * changes, so that a property set after it was requested is fetched again.
+ * override redirect windows are never managed, so they are ignored */
+void createnotify(xcb_generic_event_t *e) {
+    xcb_create_notify_event_t *ev = (xcb_create_notify_event_t*)e;
+    prefetch *p = NULL;
+    if (ev->override_redirect || ev->parent != screen->root || prefetch_find(ev->window)) return;
+    DEBUG("xcb: create notify");
+
+    for (unsigned int i=0; i<PREFETCH && !p; i++) if (prefetched[i].win == XCB_NONE) p = &prefetched[i];
+    if (!p) prefetch_discard((p = &prefetched[prefetch_evict++ % PREFETCH]));
+
+    unsigned int values[1] = { XCB_EVENT_MASK_PROPERTY_CHANGE };
+    xcb_change_window_attributes(dis, ev->window, XCB_CW_EVENT_MASK, values);
+    p->win = ev->window;
+    prefetch_window(p, XCB_NONE);
 }
 
 /* close the window */
@@ -476,29 +998,160 @@ void deletewindow(xcb_window_t w) {
  *   whether the desktop is the current focused (1) or not (0)
  *   whether any client in that desktop has received an urgent hint
  *
- * once the info is collected, immediately flush the stream */
+ * once the info is collected it's written, unless it's the same as the last.
+ * the wm must not block on a slow reader, so it's only written as far as
+ * the stream takes it, and the rest once it's writable again. while a line
+ * is being written only the latest next one is kept, older ones are dropped */
 void desktopinfo(void) {
-    bool urgent = false;
-    int cd = current_desktop, n=0, d=0;
-    for (client *c; d<DESKTOPS; d++) {
-        for (select_desktop(d), c=head, n=0, urgent=false; c; c=c->next, ++n) if (c->isurgent) urgent = true;
-        fprintf(stdout, "%d:%d:%d:%d:%d%c", d, n, mode, current_desktop == cd, urgent, d+1==DESKTOPS?'\n':' ');
+    char line[sizeof(status.line)];
+    int len = 0;
+    if (status.closed) return;
+    for (int d = 0; d<DESKTOPS; d++)
+        len += snprintf(line + len, sizeof(line) - len, "%d:%d:%d:%d:%d%c", d, desktops[d].count, desktops[d].mode,
+                        current_desktop == d, desktops[d].urgent > 0, d+1==DESKTOPS?'\n':' ');
+
+    if (!strcmp(line, status.hasnext ? status.next:status.line)) { ++stats.suppressed; return; }
+    if (status.off < status.len) {
+        if (status.hasnext) ++stats.dropped;
+        strcpy(status.next, line); status.hasnext = true;
+        return;
+    }
+    strcpy(status.line, line); status.len = len; status.off = 0;
+    status_write(STDOUT_FILENO);
+}
+
+/* handle the replies and events that arrived, returns whether there were any
+ *
+ * the events are read in batches, and coalesce() drops the redundant ones
+ * before any is handled. the rest are handled in order of priority, so that
+ * a key press doesn't wait behind a flood of property changes:
+ * first the input events, then the structural events, then all others.
+ * an event is never handled before an earlier one about the same window,
+ * and a reply is never handled before an earlier event that is not yet */
+bool dispatch(void) {
+    xcb_generic_event_t *batch[BATCH], *ev;
+    unsigned int n, from, first;
+    if (!(ev = xcb_poll_for_event(dis)) && !pending_run(NULL) && !(ev = xcb_poll_for_queued_event(dis))) return false;
+    while (ev) {
+        for (n = 0, from = 0; ev; ev = n < BATCH ? xcb_poll_for_event(dis):NULL, ++stats.events)
+            if (coalesce(batch, &from, n, ev)) batch[n++] = ev; else free(ev);
+        for (first = 0; first < n && !batch[first]; first++); /* coalesce() may drop the first ones */
+        for (unsigned int p = PRIO_INPUT; p <= PRIO_OTHER; p++)
+            for (unsigned int i = first; i < n; i++) {
+                if (!(ev = batch[i]) || (p != PRIO_OTHER && (eventpriority(ev) != p || dispatch_blocked(batch, first, i)))) continue;
+                if (running) {
+                    pending_run(batch[first]);
+                    if (events[ev->response_type & ~0x80]) events[ev->response_type & ~0x80](ev);
+                    else { DEBUGP("xcb: unimplented event: %d\n", ev->response_type & ~0x80); }
+                }
+                free(ev); batch[i] = NULL;
+                while (first < n && !batch[first]) first++;
+            }
+        ev = running ? xcb_poll_for_event(dis):NULL;
     }
-    fflush(stdout);
-    if (cd != d-1) select_desktop(cd);
+    return true;
+}
+
+/* whether an earlier event of the batch that is not handled yet is about
+ * the same window as batch[i], so batch[i] can't be handled before it */
+bool dispatch_blocked(xcb_generic_event_t **batch, unsigned int first, unsigned int i) {
+    xcb_window_t w = eventwindow(batch[i]);
+    if (w == XCB_NONE) return false;
+    for (unsigned int j = first; j < i; j++) if (batch[j] && eventwindow(batch[j]) == w) return true;
+    return false;
+}
+
+/* unlink the client from the desktop's client list */
+void detach(client *c, desktop *d) {
+    if (c == d->head) { if ((d->head = c->next)) d->head->prev = c->prev; }
+    else { c->prev->next = c->next; (c->next ? c->next:d->head)->prev = c->prev; }
+    c->next = c->prev = NULL;
 }
 
 /* a destroy notification is received when a window is being closed
  * on receival, remove the appropriate client that held that window
+ * or drop the replies of the requests made when it was created
  */
 void destroynotify(xcb_generic_event_t *e) {
     DEBUG("xcb: destoroy notify");
     xcb_destroy_notify_event_t *ev = (xcb_destroy_notify_event_t*)e;
-    client *c = wintoclient(ev->window);
-    if (c) removeclient(c);
+    client *c = NULL; desktop *d = NULL;
+    prefetch *p = prefetch_find(ev->window);
+    if (p) prefetch_discard(p);
+    if (wintoclient(ev->window, &c, &d)) removeclient(c, d);
     desktopinfo();
 }
 
+/* move or resize the dragged window to the last pointer position
+ * the window isn't moved again for 1/DRAG_RATE seconds, the motion in
+ * between is applied at once by dragtimer() when the time is up.
+ * returns false if the dragged window is gone */
+bool drag_move(void) {
+    client *c = handle_client(drag.c);
+    if (!c) return false;
+    int xw = (drag.mode == MOVE ? drag.x:drag.w) + drag.px - drag.mx;
+    int yh = (drag.mode == MOVE ? drag.y:drag.h) + drag.py - drag.my;
+    if (drag.mode == RESIZE) client_move_resize(c, drag.x, drag.y, xw>MINWSZ?xw:drag.w, yh>MINWSZ?yh:drag.h);
+    else if (drag.mode == MOVE) client_move_resize(c, xw, yh, drag.w, drag.h);
+    client_configure(c);
+
+    struct itimerspec t = { .it_value = { .tv_sec = 1 / DRAG_RATE, .tv_nsec = 1000000000L / DRAG_RATE % 1000000000L } };
+    timerfd_settime(dragfd, 0, &t, NULL);
+    drag.timed = true; drag.moved = false;
+    return true;
+}
+
+/* stop moving or resizing a window and release the pointer
+ * the last motion is applied first if it's still waiting */
+void drag_stop(void) {
+    struct itimerspec t = { .it_value = { 0, 0 } };
+    if (drag.active && drag.moved) drag_move();
+    DEBUG("xcb: ungrab");
+    xcb_ungrab_pointer(dis, XCB_CURRENT_TIME);
+    timerfd_settime(dragfd, 0, &t, NULL);
+    drag.win = XCB_NONE; drag.active = drag.timed = drag.moved = false;
+}
+
+/* the dragged window may be moved again - apply the motion since the last move */
+void dragtimer(int fd) {
+    uint64_t expired;
+    if (read(fd, &expired, sizeof(expired)) != sizeof(expired)) return;
+    drag.timed = false;
+    if (drag.active && drag.moved && !drag_move()) drag_stop();
+}
+
+/* the priority of an event, see dispatch()
+ * the enter and mapping notifications are handled along with the input,
+ * as they change what a key or button press acts on */
+unsigned int eventpriority(xcb_generic_event_t *ev) {
+    switch (ev->response_type & ~0x80) {
+        case XCB_KEY_PRESS: case XCB_KEY_RELEASE: case XCB_BUTTON_PRESS: case XCB_BUTTON_RELEASE:
+        case XCB_MOTION_NOTIFY: case XCB_ENTER_NOTIFY: case XCB_MAPPING_NOTIFY:
+            return PRIO_INPUT;
+        case XCB_CREATE_NOTIFY: case XCB_MAP_REQUEST: case XCB_UNMAP_NOTIFY: case XCB_DESTROY_NOTIFY:
+            return PRIO_STRUCTURE;
+    }
+    return PRIO_OTHER;
+}
+
+/* the window an event is about, or XCB_NONE */
+xcb_window_t eventwindow(xcb_generic_event_t *ev) {
+    switch (ev->response_type & ~0x80) {
+        case XCB_KEY_PRESS: case XCB_KEY_RELEASE:       return ((xcb_key_press_event_t*)ev)->event;
+        case XCB_BUTTON_PRESS: case XCB_BUTTON_RELEASE: return ((xcb_button_press_event_t*)ev)->event;
+        case XCB_MOTION_NOTIFY:     return ((xcb_motion_notify_event_t*)ev)->event;
+        case XCB_ENTER_NOTIFY:      return ((xcb_enter_notify_event_t*)ev)->event;
+        case XCB_CREATE_NOTIFY:     return ((xcb_create_notify_event_t*)ev)->window;
+        case XCB_MAP_REQUEST:       return ((xcb_map_request_event_t*)ev)->window;
+        case XCB_UNMAP_NOTIFY:      return ((xcb_unmap_notify_event_t*)ev)->window;
+        case XCB_DESTROY_NOTIFY:    return ((xcb_destroy_notify_event_t*)ev)->window;
+        case XCB_CONFIGURE_REQUEST: return ((xcb_configure_request_event_t*)ev)->window;
+        case XCB_PROPERTY_NOTIFY:   return ((xcb_property_notify_event_t*)ev)->window;
+        case XCB_CLIENT_MESSAGE:    return ((xcb_client_message_event_t*)ev)->window;
+    }
+    return XCB_NONE;
+}
+
 /* when the mouse enters a window's borders
  * the window, if notifying of such events (EnterWindowMask)
  * will notify the wm and will get focus */
@@ -506,101 +1159,153 @@ void enternotify(xcb_generic_event_t *e) {
     xcb_enter_notify_event_t *ev = (xcb_enter_notify_event_t*)e;
     if (!FOLLOW_MOUSE) return;
     DEBUG("xcb: enter notify");
-    client *c = wintoclient(ev->event);
-    if (c && ev->mode == XCB_NOTIFY_MODE_NORMAL && ev->detail != XCB_NOTIFY_DETAIL_INFERIOR) update_current(c);
+    client *c = NULL; desktop *d = NULL;
+    if (wintoclient(ev->event, &c, &d) && ev->mode == XCB_NOTIFY_MODE_NORMAL && ev->detail != XCB_NOTIFY_DETAIL_INFERIOR) update_current(c, d);
+}
+
+/* hash a binding code to its home slot in the dispatch table
+ * the top bits of the product depend on all bits of the code, the low bits
+ * only on its low bits, which are the modifier mask, see BINDCODE */
+static inline unsigned int bindhash(unsigned int code) {
+    return (uint32_t)(code * 2654435761u) >> bindshift;
 }
 
-/* find and focus the client which received
- * the urgent hint in the current desktop */
+/* add a binding to the dispatch table, the table must have a free slot */
+static void addbinding(unsigned int code, void (*func)(const Arg *), const Arg *arg) {
+    unsigned int h = bindhash(code);
+    while (bindtable[h].code) h = (h + 1) & (bindsize - 1);
+    bindtable[h] = (binding){ .code = code, .func = func, .arg = arg };
+}
+
+/* find the next binding for the given code after b, or the first if b is NULL
+ * a code may be bound more than once, so callers loop until NULL is returned */
+binding* findbinding(unsigned int code, binding *b) {
+    if (!bindsize) return NULL;
+    unsigned int h = b ? ((unsigned int)(b - bindtable) + 1) & (bindsize - 1):bindhash(code);
+    for (; bindtable[h].code; h = (h + 1) & (bindsize - 1)) if (bindtable[h].code == code) return &bindtable[h];
+    return NULL;
+}
+
+/* find and focus the client which received the urgent hint
+ * in the current desktop, or else in the first desktop that has one */
 void focusurgent() {
-    client *c;
-    int cd = current_desktop, d = 0;
-    for (c=head; c && !c->isurgent; c=c->next);
-    if (c) { update_current(c); return; }
-    else for (bool f=false; d<DESKTOPS && !f; d++) for (select_desktop(d), c=head; c && !(f=c->isurgent); c=c->next);
-    select_desktop(cd);
-    if (c) { change_desktop(&(Arg){.i = --d}); update_current(c); }
+    client *c = NULL;
+    int d = current_desktop;
+    if (!(urgentmask & 1u << d)) for (d = 0; d<DESKTOPS && !(urgentmask & 1u << d); d++);
+    if (d == DESKTOPS) return;
+    for (c=desktops[d].head; c && !(c->flags & URGENT); c=c->next);
+    if (d != current_desktop) change_desktop(&(Arg){.i = d});
+    update_current(c, &desktops[d]);
 }
 
 /* get a pixel with the requested color
- * to fill some window area - borders */
-unsigned int getcolor(char* color) {
+ * to fill some window area - borders
+ * until the color is allocated its rgb value is used, which is
+ * the pixel on truecolor visuals anyway */
+void getcolor(char* color, unsigned int *pixel) {
     xcb_colormap_t map = screen->default_colormap;
-    xcb_alloc_color_reply_t *c;
-    unsigned int r, g, b, rgb, pixel;
+    unsigned int r, g, b, rgb;
 
-    rgb = xcb_get_colorpixel(color);
+    *pixel = rgb = xcb_get_colorpixel(color);
     r = rgb >> 16; g = rgb >> 8 & 0xFF; b = rgb & 0xFF;
-    c = xcb_alloc_color_reply(dis, xcb_alloc_color(dis, map, r * 257, g * 257, b * 257), NULL);
-    if (!c)
-        errx(EXIT_FAILURE, "error: cannot allocate color '%s'\n", color);
+    pending_add(xcb_alloc_color(dis, map, r * 257, g * 257, b * 257).sequence, getcolor_reply, XCB_NONE, pixel);
+}
 
-    pixel = c->pixel; free(c);
-    return pixel;
+/* store the allocated pixel and have the borders drawn again */
+void getcolor_reply(void *reply, xcb_window_t win, void *data) {
+    (void)win;
+    if (!reply) { fputs("WARN: monsterwm failed to allocate a color.\n", stderr); return; }
+    *(unsigned int*)data = ((xcb_alloc_color_reply_t*)reply)->pixel;
+    desktops[current_desktop].pending |= NEED_FOCUS;
 }
 
-/* set the given client to listen to button events (presses / releases) */
-void grabbuttons(client *c) {
+/* set the given client to listen to button events (presses / releases)
+ * of the given button, or of all bound buttons if it is XCB_BUTTON_INDEX_ANY */
+void grabbuttons(client *c, unsigned int button) {
     unsigned int modifiers[] = { 0, XCB_MOD_MASK_LOCK, numlockmask, numlockmask|XCB_MOD_MASK_LOCK };
-    for (unsigned int b=0; b<LENGTH(buttons); b++)
+    for (unsigned int b=0; b<LENGTH(buttons); b++) if (button == XCB_BUTTON_INDEX_ANY || buttons[b].button == button)
         for (unsigned int m=0; m<LENGTH(modifiers); m++)
             xcb_grab_button(dis, 1, c->win, XCB_EVENT_MASK_BUTTON_PRESS, XCB_GRAB_MODE_ASYNC, XCB_GRAB_MODE_ASYNC,
                     screen->root, XCB_NONE, buttons[b].button, buttons[b].mask|modifiers[m]);
 }
 
-/* the wm should listen to key presses */
+/* the wm should listen to key presses
+ * grab every key combo and fill the dispatch table with the
+ * bound keys and buttons keyed on their code and cleaned mask */
 void grabkeys(void) {
-    xcb_keycode_t *keycode;
+    xcb_keycode_t *keycode[LENGTH(keys)];
     unsigned int modifiers[] = { 0, XCB_MOD_MASK_LOCK, numlockmask, numlockmask|XCB_MOD_MASK_LOCK };
+    unsigned int n = LENGTH(buttons);
     xcb_ungrab_key(dis, XCB_GRAB_ANY, screen->root, XCB_MOD_MASK_ANY);
+
+    /* resolve the keycodes first, to know the size of the dispatch table */
+    for (unsigned int i=0; i<LENGTH(keys); i++)
+        if ((keycode[i] = xcb_get_keycodes(keys[i].keysym)))
+            for (unsigned int k=0; keycode[i][k] != XCB_NO_SYMBOL; k++) ++n;
+    for (bindsize = 16, bindshift = 28; bindsize < 2 * n; bindsize *= 2) --bindshift;
+    free(bindtable);
+    if (!(bindtable = calloc(bindsize, sizeof(binding)))) err(EXIT_FAILURE, "cannot allocate bindings");
+
+    for (unsigned int b=0; b<LENGTH(buttons); b++) if (buttons[b].func)
+        addbinding(BINDCODE(1u, buttons[b].button, buttons[b].mask), buttons[b].func, &buttons[b].arg);
     for (unsigned int i=0; i<LENGTH(keys); i++) {
-        keycode = xcb_get_keycodes(keys[i].keysym);
-        for (unsigned int k=0; keycode[k] != XCB_NO_SYMBOL; k++)
+        if (!keycode[i]) continue;
+        for (unsigned int k=0; keycode[i][k] != XCB_NO_SYMBOL; k++) {
             for (unsigned int m=0; m<LENGTH(modifiers); m++)
-                xcb_grab_key(dis, 1, screen->root, keys[i].mod | modifiers[m], keycode[k], XCB_GRAB_MODE_ASYNC, XCB_GRAB_MODE_ASYNC);
+                xcb_grab_key(dis, 1, screen->root, keys[i].mod | modifiers[m], keycode[i][k], XCB_GRAB_MODE_ASYNC, XCB_GRAB_MODE_ASYNC);
+            /* a key is matched on its unshifted symbol, keycodes that only have it shifted are not dispatched */
+            if (keys[i].func && xcb_key_symbols_get_keysym(keysyms, keycode[i][k], 0) == keys[i].keysym)
+                addbinding(BINDCODE(0u, keycode[i][k], keys[i].mod), keys[i].func, &keys[i].arg);
+        }
+        free(keycode[i]);
     }
 }
 
 /* arrange windows in a grid */
-void grid(int hh, int cy) {
-    int n = 0, cols = 0, cn = 0, rn = 0, i = -1;
-    for (client *c = head; c; c=c->next) if (!ISFFT(c)) ++n;
+void grid(int hh, int cy, desktop *d) {
+    int n = ntiled, cols = 0, cn = 0, rn = 0;
+    (void)d;
+    if (!n) return;
     for (cols=0; cols <= n/2; cols++) if (cols*cols >= n) break; /* emulate square root */
     if (n == 5) cols = 2;
 
     int rows = n/cols, ch = hh - BORDER_WIDTH, cw = (ww - BORDER_WIDTH)/(cols?cols:1);
-    for (client *c=head; c; c=c->next) {
-        if (ISFFT(c)) continue; else ++i;
+    for (int i = 0; i < n; i++) {
         if (i/rows + 1 > cols - n%cols) rows = n/cols + 1;
-        xcb_move_resize(dis, c->win, cn*cw, cy + rn*ch/rows, cw - BORDER_WIDTH, ch/rows - BORDER_WIDTH);
+        client_move_resize(tiled[i], cn*cw, cy + rn*ch/rows, cw - BORDER_WIDTH, ch/rows - BORDER_WIDTH);
         if (++rn >= rows) { rn = 0; cn++; }
     }
 }
 
 /* on the press of a key check to see if there's a binded function to call */
 void keypress(xcb_generic_event_t *e) {
-    xcb_key_press_event_t *ev       = (xcb_key_press_event_t *)e;
-    xcb_keysym_t           keysym   = xcb_get_keysym(ev->detail);
+    xcb_key_press_event_t *ev = (xcb_key_press_event_t *)e;
     DEBUGP("xcb: keypress: code: %d mod: %d\n", ev->detail, ev->state);
-    for (unsigned int i=0; i<LENGTH(keys); i++)
-        if (keysym == keys[i].keysym && CLEANMASK(keys[i].mod) == CLEANMASK(ev->state) && keys[i].func)
-                keys[i].func(&keys[i].arg);
+    if (drag.active) { drag_stop(); return; }
+    for (binding *b = NULL; (b = findbinding(BINDCODE(0u, ev->detail, ev->state), b));) b->func(b->arg);
 }
 
 /* explicitly kill a client - close the highlighted window
- * send a delete message and remove the client */
+ * send a delete message and remove the client, once it's known
+ * whether the window supports the delete message */
 void killclient() {
-    if (!current) return;
-    xcb_icccm_get_wm_protocols_reply_t reply; unsigned int n = 0; bool got = false;
-    if (xcb_icccm_get_wm_protocols_reply(dis,
-        xcb_icccm_get_wm_protocols(dis, current->win, wmatoms[WM_PROTOCOLS]),
-        &reply, NULL)) { /* TODO: Handle error? */
-        for(; n != reply.atoms_len; ++n) if ((got = reply.atoms[n] == wmatoms[WM_DELETE_WINDOW])) break;
-        xcb_icccm_get_wm_protocols_reply_wipe(&reply);
-    }
-    if (got) deletewindow(current->win);
-    else xcb_kill_client(dis, current->win);
-    removeclient(current);
+    desktop *d = &desktops[current_desktop];
+    if (!d->current) return;
+    pending_add(xcb_icccm_get_wm_protocols(dis, d->current->win, wmatoms[WM_PROTOCOLS]).sequence,
+                killclient_reply, d->current->win, NULL);
+}
+
+/* close the window politely if it supports WM_DELETE_WINDOW, else kill it */
+void killclient_reply(void *reply, xcb_window_t win, void *data) {
+    xcb_icccm_get_wm_protocols_reply_t protocols; bool got = false;
+    client *c = NULL; desktop *d = NULL;
+    (void)data;
+    if (!wintoclient(win, &c, &d)) return;
+    if (reply && xcb_icccm_get_wm_protocols_from_reply(reply, &protocols)) /* TODO: Handle error? */
+        for (unsigned int n = 0; n != protocols.atoms_len && !got; ++n) got = protocols.atoms[n] == wmatoms[WM_DELETE_WINDOW];
+    if (got) deletewindow(win);
+    else xcb_kill_client(dis, win);
+    removeclient(c, d);
 }
 
 /* focus the previously focused desktop */
@@ -608,10 +1313,26 @@ void last_desktop() {
     change_desktop(&(Arg){.i = previous_desktop});
 }
 
+/* the keyboard mapping or the modifier mapping changed
+ * refresh the cached key symbol table, find numlock again
+ * and grab the keys by their new keycodes, see setup_keyboard() */
+void mappingnotify(xcb_generic_event_t *e) {
+    xcb_mapping_notify_event_t *ev = (xcb_mapping_notify_event_t*)e;
+    DEBUG("xcb: mapping notify");
+    if (ev->request == XCB_MAPPING_POINTER) return;
+    xcb_refresh_keyboard_mapping(keysyms, ev);
+    setup_keyboard();
+}
+
 /* a map request is received when a window wants to display itself
  * if the window has override_redirect flag set then it should not be handled
  * by the wm. if the window already has a client then there is nothing to do.
  *
+ * every request about the window is sent at once and the window is managed
+ * by maprequest_reply() when the attributes arrive. they are requested last,
+ * so by then every other reply is in and managing the window never blocks.
+ * the property requests were usually sent when the window was created.
+ *
  * get the window class and name instance and try to match against an app rule.
  * create a client for the window, that client will always be current.
  * check for transient state, and fullscreen state and the appropriate values.
@@ -619,21 +1340,38 @@ void last_desktop() {
  * display the window, else, if set, focus the new desktop.
  */
 void maprequest(xcb_generic_event_t *e) {
-    xcb_map_request_event_t            *ev = (xcb_map_request_event_t*)e;
-    xcb_window_t                       windows[] = { ev->window }, transient = 0;
-    xcb_get_window_attributes_reply_t  *attr[1];
+    xcb_map_request_event_t *ev = (xcb_map_request_event_t*)e;
+    mapreq *m; prefetch *p;
+
+    if (wintoclient(ev->window, NULL, NULL)) return;
+    DEBUG("xcb: map request");
+
+    if (!(m = malloc(sizeof(mapreq)))) err(EXIT_FAILURE, "cannot allocate map request");
+    if ((p = prefetch_find(ev->window))) { m->pf = *p; p->win = XCB_NONE; }
+    else { m->pf.win = ev->window; prefetch_window(&m->pf, XCB_NONE); }
+    m->geometry = xcb_get_geometry(dis, ev->window);
+    pending_add(xcb_get_window_attributes(dis, ev->window).sequence, maprequest_reply, ev->window, m);
+}
+
+/* manage the window once its attributes arrive, see maprequest() */
+void maprequest_reply(void *reply, xcb_window_t win, void *data) {
+    xcb_get_window_attributes_reply_t  *attr = reply;
+    mapreq                             *m = data;
+    xcb_window_t                       transient = 0;
     xcb_icccm_get_wm_class_reply_t     ch;
     xcb_get_geometry_reply_t           *geometry;
     xcb_get_property_reply_t           *prop_reply;
 
-    xcb_get_attributes(windows, attr, 1);
-    if (!attr[0] || attr[0]->override_redirect) return;
-    if (wintoclient(ev->window)) return;
-    DEBUG("xcb: map request");
+    if (!attr || attr->override_redirect || wintoclient(win, NULL, NULL)) { /* TODO: Handle error */
+        xcb_discard_reply(dis, m->geometry.sequence);
+        prefetch_discard(&m->pf);
+        free(m);
+        return;
+    }
 
     bool follow = false, floating = false;
     int cd = current_desktop, newdsk = current_desktop;
-    if (xcb_icccm_get_wm_class_reply(dis, xcb_icccm_get_wm_class(dis, ev->window), &ch, NULL)) { /* TODO: error handling */
+    if (xcb_icccm_get_wm_class_reply(dis, m->pf.wmclass, &ch, NULL)) { /* TODO: error handling */
         DEBUGP("class: %s instance: %s\n", ch.class_name, ch.instance_name);
         for (unsigned int i=0; i<LENGTH(rules); i++)
             if (strstr(ch.class_name, rules[i].class) || strstr(ch.instance_name, rules[i].class)) {
@@ -645,40 +1383,56 @@ void maprequest(xcb_generic_event_t *e) {
         xcb_icccm_get_wm_class_reply_wipe(&ch);
     }
 
-    /* might be useful in future */
-    if ((geometry = xcb_get_geometry_reply(dis, xcb_get_geometry(dis, ev->window), NULL))) { /* TODO: error handling */
+    desktop *d = &desktops[newdsk];
+    client *c = addwindow(win, d);
+
+    /* the initial geometry fills the client's geometry cache */
+    if ((geometry = xcb_get_geometry_reply(dis, m->geometry, NULL))) { /* TODO: error handling */
         DEBUGP("geom: %ux%u+%d+%d\n", geometry->width, geometry->height,
                                       geometry->x,     geometry->y);
+        c->x = geometry->x; c->y = geometry->y; c->w = geometry->width; c->h = geometry->height;
+        c->bw = geometry->border_width;
         free(geometry);
     }
 
-    if (cd != newdsk) select_desktop(newdsk);
-    client *c = addwindow(ev->window);
+    xcb_icccm_get_wm_transient_for_reply(dis, m->pf.transient, &transient, NULL); /* TODO: error handling */
+    if (transient) c->flags |= TRANSIENT|FLOATING;
+    if (floating)  c->flags |= FLOATING;
 
-    xcb_icccm_get_wm_transient_for_reply(dis, xcb_icccm_get_wm_transient_for_unchecked(dis, ev->window), &transient, NULL); /* TODO: error handling */
-    c->istransient = transient?true:false;
-    c->isfloating  = floating || c->istransient;
-
-    prop_reply  = xcb_get_property_reply(dis, xcb_get_property_unchecked(dis, 0, ev->window, netatoms[NET_WM_STATE], XCB_ATOM_ATOM, 0, 1), NULL); /* TODO: error handling */
+    /* keep the states the window was mapped with that the wm doesn't manage */
+    bool fullscrn = false;
+    prop_reply  = xcb_get_property_reply(dis, m->pf.state, NULL); /* TODO: error handling */
     if (prop_reply) {
-        if (prop_reply->format == 32) {
+        if (prop_reply->format == 32 && prop_reply->value_len) {
             xcb_atom_t *v = xcb_get_property_value(prop_reply);
-            for (unsigned int i=0; i<prop_reply->value_len; i++)
-                DEBUGP("%d : %d\n", i, v[0]);
-            setfullscreen(c, (v[0] == netatoms[NET_FULLSCREEN]));
+            for (unsigned int i=0; i<prop_reply->value_len; i++) {
+                DEBUGP("%d : %d\n", i, v[i]);
+                if (v[i] == netatoms[NET_FULLSCREEN]) fullscrn = true;
+                else if (v[i] != netatoms[NET_HIDDEN] && c->nstates < WMSTATES) c->states[c->nstates++] = v[i];
+            }
         }
         free(prop_reply);
     }
 
-    /** information for stdout **/
-    DEBUGP("transient: %d\n", c->istransient);
-    DEBUGP("floating:  %d\n", c->isfloating);
-
-    if (cd != newdsk) select_desktop(cd);
-    if (cd == newdsk) { tile(); xcb_map_window(dis, c->win); update_current(c); }
-    else if (follow) { change_desktop(&(Arg){.i = newdsk}); update_current(c); }
-    grabbuttons(c);
+    /* a window put on a desktop that stays hidden starts hidden */
+    if (cd != newdsk && !follow) c->flags |= HIDDEN;
+    if (fullscrn) setfullscreen(c, d, true); else setwmstate(c);
 
+    /** information for stdout **/
+    DEBUGP("transient: %d\n", !!(c->flags & TRANSIENT));
+    DEBUGP("floating:  %d\n", !!(c->flags & FLOATING));
+
+    /* a new window is mapped by arrange() once it is configured, see MAPPING */
+    if (cd == newdsk) { c->flags |= MAPPING; tile(d); update_current(c, d); }
+    else if (follow) {
+        if (PARK_HIDDEN) c->flags |= MAPPING; /* else change_desktop() maps it */
+        tile(d); update_current(c, d); change_desktop(&(Arg){.i = newdsk});
+    } else if (PARK_HIDDEN) {
+        c->config |= XCB_CONFIG_WINDOW_X; c->flags |= MAPPING; tile(d);
+    } else tile(d);
+    grabbuttons(c, XCB_BUTTON_INDEX_ANY);
+
+    free(m);
     desktopinfo();
 }
 
@@ -686,186 +1440,247 @@ void maprequest(xcb_generic_event_t *e) {
  * all pointer movement events will be reported until it's ungrabbed
  * until the mouse button has not been released,
  * grab the interesting events - button press/release and pointer motion
- * and on on pointer movement resize or move the window under the curson.
- * if the received event is a map request or a configure request call the
- * appropriate handler, and stop listening for other events.
- * Ungrab the poitner and event handling is passed back to run() function.
+ * and on pointer movement motionnotify() resizes or moves the current window.
+ * a key press or a button press or release stops the drag, while every
+ * other event is handled by run() as usual.
  * Once a window has been moved or resized, it's marked as floating. */
 void mousemotion(const Arg *arg) {
-    xcb_get_geometry_reply_t  *geometry;
-    xcb_query_pointer_reply_t *pointer;
-    xcb_grab_pointer_reply_t  *grab_reply;
-    int mx, my, winx, winy, winw, winh, xw, yh;
-
-    if (!current) return;
-    geometry = xcb_get_geometry_reply(dis, xcb_get_geometry(dis, current->win), NULL); /* TODO: error handling */
-    if (geometry) {
-        winx = geometry->x;     winy = geometry->y;
-        winw = geometry->width; winh = geometry->height;
-        free(geometry);
-    } else return;
-
-    pointer = xcb_query_pointer_reply(dis, xcb_query_pointer(dis, screen->root), 0);
-    if (!pointer) return;
-    mx = pointer->root_x; my = pointer->root_y;
-
-    grab_reply = xcb_grab_pointer_reply(dis, xcb_grab_pointer(dis, 0, screen->root, BUTTONMASK|XCB_EVENT_MASK_BUTTON_MOTION|XCB_EVENT_MASK_POINTER_MOTION,
-            XCB_GRAB_MODE_ASYNC, XCB_GRAB_MODE_ASYNC, XCB_NONE, XCB_NONE, XCB_CURRENT_TIME), NULL);
-    if (!grab_reply || grab_reply->status != XCB_GRAB_STATUS_SUCCESS) return;
-
-    if (current->isfullscrn) setfullscreen(current, False);
-    if (!current->isfloating) current->isfloating = True;
-    tile(); update_current(current);
-
-    xcb_generic_event_t *e = NULL;
-    xcb_motion_notify_event_t *ev = NULL;
-    bool ungrab = false;
-    do {
-        if (e) free(e); xcb_flush(dis);
-        while(!(e = xcb_wait_for_event(dis))) xcb_flush(dis);
-        switch (e->response_type & ~0x80) {
-            case XCB_CONFIGURE_REQUEST: case XCB_MAP_REQUEST:
-                events[e->response_type & ~0x80](e);
-                break;
-            case XCB_MOTION_NOTIFY:
-                ev = (xcb_motion_notify_event_t*)e;
-                xw = (arg->i == MOVE ? winx : winw) + ev->root_x - mx;
-                yh = (arg->i == MOVE ? winy : winh) + ev->root_y - my;
-                if (arg->i == RESIZE) xcb_resize(dis, current->win, xw>MINWSZ?xw:winw, yh>MINWSZ?yh:winh);
-                else if (arg->i == MOVE) xcb_move(dis, current->win, xw, yh);
-                xcb_flush(dis);
-                break;
-            case XCB_KEY_PRESS:
-            case XCB_KEY_RELEASE:
-            case XCB_BUTTON_PRESS:
-            case XCB_BUTTON_RELEASE:
-                ungrab = true;
-        }
-    } while(!ungrab && current);
-    DEBUG("xcb: ungrab");
-    xcb_ungrab_pointer(dis, XCB_CURRENT_TIME);
-}
-
-/* each window should cover all the available screen space */
-void monocle(int hh, int cy) {
-    for (client *c=head; c; c=c->next) if (!ISFFT(c)) xcb_move_resize(dis, c->win, 0, cy, ww, hh);
+    desktop *d = &desktops[current_desktop];
+    if (!d->current || drag.win) return;
+    drag.win = d->current->win; drag.mode = arg->i;
+    pending_add(xcb_query_pointer(dis, screen->root).sequence, mousemotion_pointer, drag.win, NULL);
+    pending_add(xcb_grab_pointer(dis, 0, screen->root, BUTTONMASK|XCB_EVENT_MASK_BUTTON_MOTION|XCB_EVENT_MASK_POINTER_MOTION,
+                XCB_GRAB_MODE_ASYNC, XCB_GRAB_MODE_ASYNC, XCB_NONE, XCB_NONE, XCB_CURRENT_TIME).sequence, mousemotion_grab, drag.win, NULL);
+}
+
+/* the pointer is grabbed - start the drag from the window's current geometry */
+void mousemotion_grab(void *reply, xcb_window_t win, void *data) {
+    xcb_grab_pointer_reply_t *grab = reply;
+    client *c = NULL; desktop *d = NULL;
+    (void)data;
+    if (!grab || grab->status != XCB_GRAB_STATUS_SUCCESS) { if (drag.win == win) drag.win = XCB_NONE; return; }
+    if (drag.win != win || !wintoclient(win, &c, &d) || d != &desktops[current_desktop]) { drag_stop(); return; }
+
+    if (c->flags & FULLSCRN) setfullscreen(c, d, False);
+    c->flags |= FLOATING;
+    tile(d); update_current(c, d);
+    drag.x = c->x; drag.y = c->y; drag.w = c->w; drag.h = c->h;
+    drag.px = drag.mx; drag.py = drag.my;
+    drag.c = client_handle(c);
+    drag.active = true;
+}
+
+/* remember where the pointer was when the drag started */
+void mousemotion_pointer(void *reply, xcb_window_t win, void *data) {
+    xcb_query_pointer_reply_t *pointer = reply;
+    (void)data;
+    if (drag.win != win) return;
+    if (!pointer) { drag.win = XCB_NONE; return; }
+    drag.mx = pointer->root_x; drag.my = pointer->root_y;
+}
+
+/* move or resize the dragged window along with the pointer */
+void motionnotify(xcb_generic_event_t *e) {
+    xcb_motion_notify_event_t *ev = (xcb_motion_notify_event_t*)e;
+    if (!drag.active) return;
+    drag.px = ev->root_x; drag.py = ev->root_y;
+    if (drag.timed) drag.moved = true;
+    else if (!drag_move()) drag_stop();
+}
+
+/* each window should cover all the available screen space
+ *
+ * only the current window is visible, so only it is sized, the others are
+ * sized as they become current - update_current() tiles a monocle desktop.
+ * with MONOCLE_PRESIZE the next and previous windows are sized ahead.
+ * when the current window floats the top tiled window shows below it,
+ * so then every window is sized */
+void monocle(int hh, int cy, desktop *d) {
+    unsigned int i = 0;
+    if (!d->current || ISFFT(d->current)) {
+        for (i = 0; i < ntiled; i++) client_move_resize(tiled[i], 0, cy, ww, hh);
+        return;
+    }
+    while (tiled[i] != d->current) i++;
+    client_move_resize(tiled[i], 0, cy, ww, hh);
+    if (!MONOCLE_PRESIZE) return;
+    client_move_resize(tiled[(i + 1) % ntiled], 0, cy, ww, hh);
+    client_move_resize(tiled[(i + ntiled - 1) % ntiled], 0, cy, ww, hh);
 }
 
 /* move the current client, to current->next
  * and current->next to current client's position */
 void move_down() {
-    /* p is previous, c is current, n is next, if current is head n is last */
-    client *p = NULL, *n = (current->next) ? current->next:head;
-    if (!(p = prev_client(current))) return;
-    /*
-     * if c is head, swapping with n should update head to n
-     * [c]->[n]->..  ==>  [n]->[c]->..
-     *  ^head              ^head
-     *
-     * else there is a previous client and p->next should be what's after c
-     * ..->[p]->[c]->[n]->..  ==>  ..->[p]->[n]->[c]->..
-     */
-    if (current == head) head = n; else p->next = current->next;
+    desktop *d = &desktops[current_desktop];
+    if (!d->current || !d->head->next) return;
+    client *c = d->current, *n = c->next;
     /*
-     * if c is the last client, c will be the current head
-     * [n]->..->[p]->[c]->NULL  ==>  [c]->[n]->..->[p]->NULL
-     *  ^head                         ^head
-     * else c will take the place of n, so c-next will be n->next
-     * ..->[p]->[c]->[n]->..  ==>  ..->[p]->[n]->[c]->..
+     * c takes the place of n, or if c is the last client it becomes the head
+     * ..->[c]->[n]->..  ==>  ..->[n]->[c]->..
+     * [h]->..->[p]->[c]->NULL  ==>  [c]->[h]->..->[p]->NULL
      */
-    current->next = (current->next) ? n->next:n;
-    /*
-     * if c was swapped with n then they now point to the same ->next. n->next should be c
-     * ..->[p]->[c]->[n]->..  ==>  ..->[p]->[n]->..  ==>  ..->[p]->[n]->[c]->..
-     *                                        [c]-^
-     *
-     * else c is the last client and n is head,
-     * so c will be move to be head, no need to update n->next
-     * [n]->..->[p]->[c]->NULL  ==>  [c]->[n]->..->[p]->NULL
-     *  ^head                         ^head
-     */
-    if (current->next == n->next) n->next = current; else head = current;
-    tile();
+    detach(c, d);
+    attach(c, d, n ? n->next:d->head);
+    tile(d);
 }
 
 /* move the current client, to the previous from current and
  * the previous from  current to current client's position */
 void move_up() {
-    client *pp = NULL, *p;
-    /* p is previous from current or last if current is head */
-    if (!(p = prev_client(current))) return;
-    /* pp is previous from p, or null if current is head and thus p is last */
-    if (p->next) for (pp=head; pp && pp->next != p; pp=pp->next);
+    desktop *d = &desktops[current_desktop];
+    if (!d->current || !d->head->next) return;
+    client *c = d->current, *p = c == d->head ? NULL:c->prev;
     /*
-     * if p has a previous client then the next client should be current (current is c)
-     * ..->[pp]->[p]->[c]->..  ==>  ..->[pp]->[c]->[p]->..
-     *
-     * if p doesn't have a previous client, then p might be head, so head must change to c
-     * [p]->[c]->..  ==>  [c]->[p]->..
-     *  ^head              ^head
-     * if p is not head, then c is head (and p is last), so the new head is next of c
-     * [c]->[n]->..->[p]->NULL  ==>  [n]->..->[p]->[c]->NULL
-     *  ^head         ^last           ^head         ^last
+     * c takes the place of p, or if c is the head it becomes the last client
+     * ..->[p]->[c]->..  ==>  ..->[c]->[p]->..
+     * [c]->[n]->..->[l]->NULL  ==>  [n]->..->[l]->[c]->NULL
      */
-    if (pp) pp->next = current; else head = (current == head) ? current->next:current;
-    /*
-     * next of p should be next of c
-     * ..->[pp]->[p]->[c]->[n]->..  ==>  ..->[pp]->[c]->[p]->[n]->..
-     * except if c was head (now c->next is head), so next of p should be c
-     * [c]->[n]->..->[p]->NULL  ==>  [n]->..->[p]->[c]->NULL
-     *  ^head         ^last           ^head         ^last
-     */
-    p->next = (current->next == head) ? current:current->next;
-    /*
-     * next of c should be p
-     * ..->[pp]->[p]->[c]->[n]->..  ==>  ..->[pp]->[c]->[p]->[n]->..
-     * except if c was head (now c->next is head), so c is must be last
-     * [c]->[n]->..->[p]->NULL  ==>  [n]->..->[p]->[c]->NULL
-     *  ^head         ^last           ^head         ^last
-     */
-    current->next = (current->next == head) ? NULL:p;
-    tile();
+    detach(c, d);
+    attach(c, d, p);
+    tile(d);
 }
 
 /* cyclic focus the next window
  * if the window is the last on stack, focus head */
 void next_win() {
-    if (!current || !head->next) return;
-    update_current(current->next ? current->next:head);
+    desktop *d = &desktops[current_desktop];
+    if (!d->current || !d->head->next) return;
+    update_current(d->current->next ? d->current->next:d->head, d);
 }
 
-/* get the previous client from the given
+/* get the previous client from the given, the last one if it's the head
  * if no such client, return NULL */
-client* prev_client(client *c) {
-    if (!c || !head->next) return NULL;
-    client *p; for (p=head; p->next && p->next != c; p=p->next);
-    return p;
+client* prev_client(client *c, desktop *d) {
+    return (!c || !d->head->next) ? NULL:c->prev;
+}
+
+/* wait for the reply of a request without blocking, func is called by
+ * pending_run() with the reply, which is freed once func returns */
+void pending_add(unsigned int sequence, void (*func)(void *, xcb_window_t, void *), xcb_window_t win, void *data) {
+    if (pendcount == pendsize) {
+        pending *old = pendtable;
+        unsigned int oldsize = pendsize;
+        pendsize = pendsize ? pendsize * 2:32;
+        if (!(pendtable = malloc(pendsize * sizeof(pending)))) err(EXIT_FAILURE, "cannot allocate pending replies");
+        for (unsigned int n = 0; n < pendcount; n++) pendtable[n] = old[(pendfirst + n) & (oldsize - 1)];
+        pendfirst = 0;
+        free(old);
+    }
+    pendtable[(pendfirst + pendcount++) & (pendsize - 1)] = (pending){ sequence, func, win, data };
+}
+
+/* call the continuations of the replies that arrived, in request order
+ * if ev is given, only of the replies that the server sent before ev
+ * returns whether any was called */
+bool pending_run(xcb_generic_event_t *ev) {
+    void *reply = NULL; xcb_generic_error_t *error = NULL; bool ran = false;
+    while (pendcount && (!ev || (int)(pendtable[pendfirst].sequence - ev->full_sequence) <= 0)
+                     && xcb_poll_for_reply(dis, pendtable[pendfirst].sequence, &reply, &error)) {
+        pending p = pendtable[pendfirst];
+        pendfirst = (pendfirst + 1) & (pendsize - 1); --pendcount;
+        free(error); error = NULL;
+        p.func(reply, p.win, p.data);
+        free(reply); reply = NULL;
+        ran = true;
+    }
+    return ran;
+}
+
+/* drop the replies of the requests about a window and free its entry */
+void prefetch_discard(prefetch *p) {
+    xcb_discard_reply(dis, p->wmclass.sequence);
+    xcb_discard_reply(dis, p->transient.sequence);
+    xcb_discard_reply(dis, p->state.sequence);
+    p->win = XCB_NONE;
+}
+
+/* find the entry of the window whose properties were requested, or NULL */
+prefetch* prefetch_find(xcb_window_t w) {
+    for (unsigned int i=0; i<PREFETCH; i++) if (prefetched[i].win == w) return &prefetched[i];
+    return NULL;
+}
+
+/* request the properties maprequest() needs about the entry's window
+ * if atom is not XCB_NONE only that property is requested again */
+void prefetch_window(prefetch *p, xcb_atom_t atom) {
+    if (atom == XCB_NONE || atom == XCB_ATOM_WM_CLASS) {
+        if (atom) xcb_discard_reply(dis, p->wmclass.sequence);
+        p->wmclass = xcb_icccm_get_wm_class(dis, p->win);
+    }
+    if (atom == XCB_NONE || atom == XCB_ATOM_WM_TRANSIENT_FOR) {
+        if (atom) xcb_discard_reply(dis, p->transient.sequence);
+        p->transient = xcb_icccm_get_wm_transient_for_unchecked(dis, p->win);
+    }
+    if (atom == XCB_NONE || atom == netatoms[NET_WM_STATE]) {
+        if (atom) xcb_discard_reply(dis, p->state.sequence);
+        p->state = xcb_get_property_unchecked(dis, 0, p->win, netatoms[NET_WM_STATE], XCB_ATOM_ATOM, 0, WMSTATES + 2);
+    }
 }
 
 /* cyclic focus the previous window
  * if the window is the head, focus the last stack window */
 void prev_win() {
-    if (!current || !head->next) return;
-    update_current(prev_client(prevfocus = current));
+    desktop *d = &desktops[current_desktop];
+    if (!d->current || !d->head->next) return;
+    update_current(prev_client(d->prevfocus = d->current, d), d);
 }
 
 /* property notify is called when one of the window's properties
  * is changed, such as an urgent hint is received
+ * a window that is not managed yet gets the changed property requested again
+ * only watched properties get here, the others are dropped by coalesce()
  */
 void propertynotify(xcb_generic_event_t *e) {
     xcb_property_notify_event_t *ev = (xcb_property_notify_event_t*)e;
-    xcb_icccm_wm_hints_t wmh;
-    client *c;
+    prefetch *p = NULL;
 
     DEBUG("xcb: property notify");
-    c = wintoclient(ev->window);
-    if (!c || ev->atom != XCB_ICCCM_WM_ALL_HINTS) return;
+    if ((p = prefetch_find(ev->window))) { prefetch_window(p, ev->atom); return; }
+    if (ev->atom != XCB_ATOM_WM_HINTS || !wintoclient(ev->window, NULL, NULL)) return;
     DEBUG("xcb: got hint!");
-    if (xcb_icccm_get_wm_hints_reply(dis, xcb_icccm_get_wm_hints(dis, ev->window), &wmh, NULL)) /* TODO: error handling */
-        c->isurgent = c != current && (wmh.flags & XCB_ICCCM_WM_HINT_X_URGENCY);
+    pending_add(xcb_icccm_get_wm_hints(dis, ev->window).sequence, propertynotify_reply, ev->window, NULL);
+}
+
+/* mark the client urgent if its new hints say so
+ * the desktop info is only printed when the urgency changed */
+void propertynotify_reply(void *reply, xcb_window_t win, void *data) {
+    xcb_icccm_wm_hints_t wmh;
+    client *c = NULL; desktop *d = NULL;
+    (void)data;
+    if (!reply || !wintoclient(win, &c, &d) || !xcb_icccm_get_wm_hints_from_reply(&wmh, reply)) return; /* TODO: error handling */
+    bool urgent = c != d->current && (wmh.flags & XCB_ICCCM_WM_HINT_X_URGENCY);
+    if (!urgent == !(c->flags & URGENT)) return;
+    client_urgent(c, d, urgent);
     desktopinfo();
 }
 
+/* read the signals sent to the wm
+ * SIGCHLD reaps the exited children, SIGTERM quits with exit value 1
+ * and SIGUSR1 quits with exit value 0, like the quit keys do.
+ * SIGUSR2 prints how many events were coalesced on standard error.
+ * SIGPIPE is only blocked, so that a closed standard output fails the write */
+void readsignal(int fd) {
+    struct signalfd_siginfo si;
+    while (read(fd, &si, sizeof(si)) == sizeof(si)) switch (si.ssi_signo) {
+        case SIGCHLD: while(0 < waitpid(-1, NULL, WNOHANG)); break;
+        case SIGTERM: quit(&(Arg){.i = 1}); break;
+        case SIGUSR1: quit(&(Arg){.i = 0}); break;
+        case SIGUSR2:
+            fprintf(stderr, "events: %lu coalesced: motion %lu enter %lu property %lu configure %lu ignored property %lu\n"
+                            "status: suppressed %lu dropped %lu\n",
+                    stats.events, stats.motion, stats.enter, stats.property, stats.configure, stats.ignored,
+                    stats.suppressed, stats.dropped);
+            break;
+    }
+}
+
+/* whether the changes of a property are handled */
+bool propertywatched(xcb_atom_t atom) {
+    if (atom == netatoms[NET_WM_STATE]) return true;
+    for (unsigned int i=0; i<LENGTH(WATCHED_ATOMS); i++) if (WATCHED_ATOMS[i] == atom) return true;
+    return false;
+}
+
 /* to quit just stop receiving events
  * run() is stopped and control is back to main()
  */
@@ -874,38 +1689,71 @@ void quit(const Arg *arg) {
     running = false;
 }
 
-/* remove the specified client
+/* remove the specified client from the given desktop
  *
  * note, the removing client can be on any desktop,
- * we must return back to the current focused desktop.
+ * only the current desktop needs to be tiled again.
  * if c was the previously focused, prevfocus must be updated
  * else if c was the current one, current must be updated. */
-void removeclient(client *c) {
-    client **p = NULL;
-    int nd = 0, cd = current_desktop;
-    for (bool found = false; nd<DESKTOPS && !found; nd++)
-        for (select_desktop(nd), p = &head; *p && !(found = *p == c); p = &(*p)->next);
-    *p = c->next;
-    if (c == prevfocus) prevfocus = prev_client(current);
-    if (c == current || !head->next) update_current(prevfocus);
-    free(c); c = NULL;
-    if (cd == nd -1) tile(); else select_desktop(cd);
+void removeclient(client *c, desktop *d) {
+    detach(c, d);
+    if (c == d->prevfocus) d->prevfocus = prev_client(d->current, d);
+    if (c == d->current || !d->head || !d->head->next) update_current(d->prevfocus, d);
+    client_urgent(c, d, false);
+    d->count--;
+    winindex_del(c->win);
+    client_free(c); c = NULL;
+    tile(d);
 }
 
 /* resize the master window - check for boundary size limits
  * the size of a window can't be less than MINWSZ
  */
 void resize_master(const Arg *arg) {
-    int msz = (mode == BSTACK ? wh:ww) * MASTER_SIZE + master_size + arg->i;
-    if (msz < MINWSZ || (mode == BSTACK ? wh:ww) - msz < MINWSZ) return;
-    master_size += arg->i;
-    tile();
+    desktop *d = &desktops[current_desktop];
+    int msz = (d->mode == BSTACK ? wh:ww) * MASTER_SIZE + d->master_size + arg->i;
+    if (msz < MINWSZ || (d->mode == BSTACK ? wh:ww) - msz < MINWSZ) return;
+    d->master_size += arg->i;
+    tile(d);
 }
 
 /* resize the first stack window - no boundary checks */
 void resize_stack(const Arg *arg) {
-    growth += arg->i;
-    tile();
+    desktops[current_desktop].growth += arg->i;
+    tile(&desktops[current_desktop]);
+}
+
+/* restack the given windows of a desktop into that order, bottom to top
+ *
+ * only the windows that are out of place are moved. the windows whose last
+ * stack positions form the longest increasing run are already in order
+ * among themselves and stay, every other window is stacked right above
+ * its lower neighbour, or below the lowest staying window if it's first.
+ * moving the focus usually moves one or two windows, whatever their number */
+void restack(client **s, int n) {
+    int tail[n + 1], link[n + 1], len = 0, first = -1, lo, hi, mid;
+    bool keep[n + 1];
+
+    for (int i = 0; i < n; i++) {
+        keep[i] = false; link[i] = -1;
+        if (s[i]->stackpos < 0) continue;
+        for (lo = 0, hi = len; lo < hi;) {
+            mid = (lo + hi)/2;
+            if (s[tail[mid]]->stackpos < s[i]->stackpos) lo = mid + 1; else hi = mid;
+        }
+        link[i] = lo ? tail[lo - 1]:-1;
+        tail[lo] = i; if (lo == len) ++len;
+    }
+    for (int i = len ? tail[len - 1]:-1; i >= 0; i = link[i]) keep[(first = i)] = true;
+
+    for (int i = 0; i < n; i++) {
+        if (!keep[i]) {
+            if (i) client_stack(s[i], s[i-1]->win, XCB_STACK_MODE_ABOVE);
+            else if (first >= 0) client_stack(s[i], s[first]->win, XCB_STACK_MODE_BELOW);
+            else client_stack(s[i], XCB_NONE, XCB_STACK_MODE_ABOVE);
+        }
+        s[i]->stackpos = i;
+    }
 }
 
 /* jump and focus the next or previous desktop */
@@ -920,90 +1768,82 @@ void rotate_filled(const Arg *arg) {
     change_desktop(&(Arg){.i = (DESKTOPS + current_desktop + n) % DESKTOPS});
 }
 
-/* main event loop - on receival of an event call the appropriate event handler */
+/* main event loop - on receival of an event call the appropriate event handler
+ * every event already queued is handled before the desktops are arranged,
+ * so the layout and focus changes they caused are applied once.
+ * the loop sleeps in epoll until one of the sources is readable, but only
+ * when there is neither an event nor a reply left to handle */
 void run(void) {
-    xcb_generic_event_t *ev;
+    struct epoll_event ev[SOURCES];
+    source *s;
     while(running) {
+        for (int i = 0; i < DESKTOPS; i++) if (desktops[i].pending) arrange(&desktops[i]);
         xcb_flush(dis);
         if (xcb_connection_has_error(dis)) err(EXIT_FAILURE, "error: X11 connection got interrupted\n");
-        if ((ev = xcb_wait_for_event(dis))) {
-            if (events[ev->response_type & ~0x80]) events[ev->response_type & ~0x80](ev);
-            else { DEBUGP("xcb: unimplented event: %d\n", ev->response_type & ~0x80); }
-            free(ev);
-        }
+        int n = epoll_wait(epfd, ev, SOURCES, dispatch() ? 0:-1);
+        for (int i = 0; i < n; i++) if ((s = ev[i].data.ptr)->func) s->func(s->fd);
     }
 }
 
-/* save specified desktop's properties */
-void save_desktop(int i) {
-    if (i < 0 || i >= DESKTOPS) return;
-    desktops[i].master_size = master_size;
-    desktops[i].mode        = mode;
-    desktops[i].growth      = growth;
-    desktops[i].head        = head;
-    desktops[i].current     = current;
-    desktops[i].showpanel   = showpanel;
-    desktops[i].prevfocus   = prevfocus;
-}
-
-/* set the specified desktop's properties */
-void select_desktop(int i) {
-    if (i < 0 || i >= DESKTOPS) return;
-    save_desktop(current_desktop);
-    master_size     = desktops[i].master_size;
-    mode            = desktops[i].mode;
-    growth          = desktops[i].growth;
-    head            = desktops[i].head;
-    current         = desktops[i].current;
-    showpanel       = desktops[i].showpanel;
-    prevfocus       = desktops[i].prevfocus;
-    current_desktop = i;
-}
-
 void fullscreen_toggle() {
-    if (!current) return;
-    setfullscreen(current, !current->isfullscrn);
+    desktop *d = &desktops[current_desktop];
+    if (!d->current) return;
+    setfullscreen(d->current, d, !(d->current->flags & FULLSCRN));
 }
 
 /* set or unset fullscreen state of client */
-void setfullscreen(client *c, bool fullscrn) {
+void setfullscreen(client *c, desktop *d, bool fullscrn) {
     DEBUGP("xcb: set fullscreen: %d\n", fullscrn);
-    current->isfloating = fullscrn;
-    long data[] = { fullscrn ? netatoms[NET_FULLSCREEN] : XCB_NONE };
-    if (fullscrn != c->isfullscrn) xcb_change_property(dis, XCB_PROP_MODE_REPLACE, c->win, netatoms[NET_WM_STATE], XCB_ATOM_ATOM, 32, fullscrn, data);
-    if ((c->isfullscrn = fullscrn)) xcb_move_resize(dis, c->win, 0, 0, ww, wh + PANEL_HEIGHT);
-    xcb_border_width(dis, c->win, (!head->next || c->isfullscrn
-                || (mode == MONOCLE && !ISFFT(c))) ? 0:BORDER_WIDTH);
-    update_current(c);
-}
-
-/* get numlock modifier using xcb */
-int setup_keyboard(void)
-{
-    xcb_get_modifier_mapping_reply_t *reply;
+    bool changed = fullscrn != !!(c->flags & FULLSCRN);
+    c->flags = (c->flags & ~(FULLSCRN|FLOATING)) | (fullscrn ? FULLSCRN|FLOATING:0);
+    if (changed) setwmstate(c);
+    if (fullscrn) client_move_resize(c, 0, 0, ww, wh + PANEL_HEIGHT);
+    client_border_width(c, (!d->head->next || fullscrn
+                || (d->mode == MONOCLE && !ISFFT(c))) ? 0:BORDER_WIDTH);
+    tile(d); update_current(c, d);
+}
+
+/* set the window's WM_STATE, iconic when hidden else normal, and its
+ * _NET_WM_STATE to the fullscreen and hidden state of the client along
+ * with the states the window was mapped with */
+void setwmstate(client *c) {
+    xcb_atom_t data[WMSTATES + 2]; unsigned int n = 0;
+    for (; n < c->nstates; n++) data[n] = c->states[n];
+    uint32_t state[2] = { c->flags & HIDDEN ? XCB_ICCCM_WM_STATE_ICONIC:XCB_ICCCM_WM_STATE_NORMAL, XCB_NONE };
+    if (c->flags & FULLSCRN) data[n++] = netatoms[NET_FULLSCREEN];
+    if (c->flags & HIDDEN)   data[n++] = netatoms[NET_HIDDEN];
+    xcb_change_property(dis, XCB_PROP_MODE_REPLACE, c->win, wmatoms[WM_STATE], wmatoms[WM_STATE], 32, 2, state);
+    xcb_change_property(dis, XCB_PROP_MODE_REPLACE, c->win, netatoms[NET_WM_STATE], XCB_ATOM_ATOM, 32, n, data);
+}
+
+/* get numlock modifier using xcb, and grab the keys once it's known */
+void setup_keyboard(void) {
+    pending_add(xcb_get_modifier_mapping_unchecked(dis).sequence, setup_keyboard_reply, XCB_NONE, NULL);
+}
+
+/* find the modifier numlock is mapped to and grab the keys */
+void setup_keyboard_reply(void *reply, xcb_window_t win, void *data) {
+    xcb_get_modifier_mapping_reply_t *mods = reply;
     xcb_keycode_t                    *modmap;
     xcb_keycode_t                    *numlock;
-
-    reply   = xcb_get_modifier_mapping_reply(dis, xcb_get_modifier_mapping_unchecked(dis), NULL); /* TODO: error checking */
-    if (!reply) return -1;
-
-    modmap = xcb_get_modifier_mapping_keycodes(reply);
-    if (!modmap) return -1;
-
-    numlock = xcb_get_keycodes(XK_Num_Lock);
-    for (unsigned int i=0; i<8; i++)
-       for (unsigned int j=0; j<reply->keycodes_per_modifier; j++) {
-           xcb_keycode_t keycode = modmap[i * reply->keycodes_per_modifier + j];
-           if (keycode == XCB_NO_SYMBOL) continue;
-           for (unsigned int n=0; numlock[n] != XCB_NO_SYMBOL; n++)
-               if (numlock[n] == keycode) {
-                   DEBUGP("xcb: found num-lock %d\n", 1 << i);
-                   numlockmask = 1 << i;
-                   break;
-               }
-       }
-
-    return 0;
+    (void)win; (void)data;
+
+    numlockmask = 0;
+    if (mods && (modmap = xcb_get_modifier_mapping_keycodes(mods)) && (numlock = xcb_get_keycodes(XK_Num_Lock))) {
+        for (unsigned int i=0; i<8; i++)
+           for (unsigned int j=0; j<mods->keycodes_per_modifier; j++) {
+               xcb_keycode_t keycode = modmap[i * mods->keycodes_per_modifier + j];
+               if (keycode == XCB_NO_SYMBOL) continue;
+               for (unsigned int n=0; numlock[n] != XCB_NO_SYMBOL; n++)
+                   if (numlock[n] == keycode) {
+                       DEBUGP("xcb: found num-lock %d\n", 1 << i);
+                       numlockmask = 1 << i;
+                       break;
+                   }
+           }
+        free(numlock);
+    } else if (!mods) fputs("WARN: monsterwm failed to get the modifier mapping.\n", stderr);
+    grabkeys();
 }
 
 /* set initial values
@@ -1012,41 +1852,63 @@ int setup_keyboard(void)
  * and propagate the suported net atoms
  */
 int setup(int default_screen) {
-    sigchld();
     screen = xcb_screen_of_display(dis, default_screen);
     if (!screen) err(EXIT_FAILURE, "error: cannot aquire screen\n");
 
+    /* the signals are read from sigfd by run(), so they are blocked and
+     * never interrupt a handler. children get the default mask back */
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGCHLD); sigaddset(&set, SIGTERM); sigaddset(&set, SIGUSR1); sigaddset(&set, SIGUSR2);
+    sigaddset(&set, SIGPIPE);
+    if (sigprocmask(SIG_BLOCK, &set, NULL) == -1 || (sigfd = signalfd(-1, &set, SFD_NONBLOCK|SFD_CLOEXEC)) == -1)
+        err(EXIT_FAILURE, "cannot set up signals");
+    while(0 < waitpid(-1, NULL, WNOHANG));
+    if ((epfd = epoll_create1(EPOLL_CLOEXEC)) == -1 || (dragfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC)) == -1)
+        err(EXIT_FAILURE, "cannot set up event sources");
+    if (!source_add(xcb_get_file_descriptor(dis), EPOLLIN, NULL) || !source_add(sigfd, EPOLLIN, readsignal)
+            || !source_add(dragfd, EPOLLIN, dragtimer))
+        err(EXIT_FAILURE, "cannot wait on event sources");
+    status.src = source_add(STDOUT_FILENO, 0, status_write);
+
     ww = screen->width_in_pixels;
     wh = screen->height_in_pixels - PANEL_HEIGHT;
-    for (unsigned int i=0; i<DESKTOPS; i++) save_desktop(i);
+    for (unsigned int i=0; i<DESKTOPS; i++) desktops[i] = (desktop){ .mode = DEFAULT_MODE, .showpanel = SHOW_PANEL };
 
-    win_focus   = getcolor(FOCUS);
-    win_unfocus = getcolor(UNFOCUS);
+    getcolor(FOCUS, &win_focus);
+    getcolor(UNFOCUS, &win_unfocus);
 
-    /* setup keyboard */
-    if (setup_keyboard() == -1)
-        err(EXIT_FAILURE, "error: failed to setup keyboard\n");
+    /* setup keyboard, the key symbol table is kept until the mapping changes */
+    if (!(keysyms = xcb_key_symbols_alloc(dis)))
+        err(EXIT_FAILURE, "error: cannot allocate key symbols\n");
+    setup_keyboard();
 
     /* set up atoms for dialog/notification windows */
     xcb_get_atoms(WM_ATOM_NAME, wmatoms, WM_COUNT);
     xcb_get_atoms(NET_ATOM_NAME, netatoms, NET_COUNT);
 
-    /* check if another wm is running */
+    /* check if another wm is running
+     * this waits for the server, so the replies above are in by now */
     if (xcb_checkotherwm())
         err(EXIT_FAILURE, "error: other wm is running\n");
+    pending_run(NULL);
 
     xcb_change_property(dis, XCB_PROP_MODE_REPLACE, screen->root, netatoms[NET_SUPPORTED], XCB_ATOM_ATOM, 32, NET_COUNT, netatoms);
-    grabkeys();
 
     /* set events */
     for (unsigned int i=0; i<XCB_NO_OPERATION; i++) events[i] = NULL;
+    events[0]                       = xerror;
     events[XCB_BUTTON_PRESS]        = buttonpress;
+    events[XCB_BUTTON_RELEASE]      = buttonrelease;
     events[XCB_CLIENT_MESSAGE]      = clientmessage;
     events[XCB_CONFIGURE_REQUEST]   = configurerequest;
+    events[XCB_CREATE_NOTIFY]       = createnotify;
     events[XCB_DESTROY_NOTIFY]      = destroynotify;
     events[XCB_ENTER_NOTIFY]        = enternotify;
     events[XCB_KEY_PRESS]           = keypress;
     events[XCB_MAP_REQUEST]         = maprequest;
+    events[XCB_MAPPING_NOTIFY]      = mappingnotify;
+    events[XCB_MOTION_NOTIFY]       = motionnotify;
     events[XCB_PROPERTY_NOTIFY]     = propertynotify;
     events[XCB_UNMAP_NOTIFY]        = unmapnotify;
 
@@ -1054,16 +1916,28 @@ int setup(int default_screen) {
     return 0;
 }
 
-void sigchld() {
-    if (signal(SIGCHLD, sigchld) == SIG_ERR)
-        err(EXIT_FAILURE, "cannot install SIGCHLD handler");
-    while(0 < waitpid(-1, NULL, WNOHANG));
+/* wait on fd in run() for the given epoll events, func is called whenever
+ * any of them occurs. returns NULL if fd can't be waited on */
+source* source_add(int fd, unsigned int events, void (*func)(int fd)) {
+    if (nsources == SOURCES) errx(EXIT_FAILURE, "error: too many event sources");
+    sources[nsources] = (source){ .fd = fd, .func = func };
+    struct epoll_event ev = { .events = events, .data.ptr = &sources[nsources] };
+    return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1 ? NULL:&sources[nsources++];
+}
+
+/* change the events run() waits for on the source */
+void source_watch(source *s, unsigned int events) {
+    struct epoll_event ev = { .events = events, .data.ptr = s };
+    epoll_ctl(epfd, EPOLL_CTL_MOD, s->fd, &ev);
 }
 
 /* execute a command */
 void spawn(const Arg *arg) {
     if (fork()) return;
-    if (dis) close(screen->root);
+    if (dis) close(xcb_get_file_descriptor(dis));
+    sigset_t set;
+    sigemptyset(&set);
+    sigprocmask(SIG_SETMASK, &set, NULL);
     setsid();
     execvp((char*)arg->com[0], (char**)arg->com);
     fprintf(stderr, "error: execvp %s", (char *)arg->com[0]);
@@ -1071,23 +1945,45 @@ void spawn(const Arg *arg) {
     exit(EXIT_SUCCESS);
 }
 
-/* arrange windows in normal or bottom stack tile */
-void stack(int hh, int cy) {
-    client *c = NULL, *t = NULL; bool b = mode == BSTACK;
-    int n = 0, d = 0, z = b ? ww:hh, ma = (mode == BSTACK ? wh:ww) * MASTER_SIZE + master_size;
+/* write as much of the status line as standard output takes without blocking
+ * fd is not made non-blocking, as that would be shared with the children.
+ * when the line is written, the next one is, if any. if not all could be
+ * written, run() calls this again once fd is writable */
+void status_write(int fd) {
+    struct pollfd p = { .fd = fd, .events = POLLOUT };
+    ssize_t n;
+    while (!status.closed && poll(&p, 1, 0) == 1) {
+        if (p.revents & (POLLERR|POLLHUP|POLLNVAL)) status.closed = true;
+        else if (status.off < status.len) {
+            if ((n = write(fd, status.line + status.off, status.len - status.off)) >= 0) status.off += n;
+            else if (errno != EAGAIN && errno != EINTR) status.closed = true;
+            else break;
+        } else if (status.hasnext) {
+            strcpy(status.line, status.next); status.len = strlen(status.line); status.off = 0;
+            status.hasnext = false;
+        } else break;
+    }
+    if (!status.src) return;
+    if (status.closed) { epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL); status.src = NULL; }
+    else source_watch(status.src, status.off < status.len ? EPOLLOUT:0);
+}
 
-    /* count stack windows and grab first non-floating, non-fullscreen window */
-    for (t = head; t; t=t->next) if (!ISFFT(t)) { if (c) ++n; else c = t; }
+/* arrange windows in normal or bottom stack tile */
+void stack(int hh, int cy, desktop *d) {
+    client *c = ntiled ? tiled[0]:NULL; bool b = d->mode == BSTACK;
+    int n = ntiled ? ntiled - 1:0, r = 0, z = b ? ww:hh, ma = (d->mode == BSTACK ? wh:ww) * MASTER_SIZE + d->master_size;
 
-    /* if there is only one window, it should cover the available screen space
+    /* n is the number of stack windows, c is the first non-floating, non-fullscreen window
+     *
+     * if there is only one window, it should cover the available screen space
      * if there is only one stack window (n == 1) then we don't care about growth
      * if more than one stack windows (n > 1) on screen then adjustments may be needed
-     *   - d is the num of pixels than remain when spliting
+     *   - r is the num of pixels than remain when spliting
      *   the available width/height to the number of windows
      *   - z is the clients' height/width
      *
      *      ----------  -.    --------------------.
-     *      |   |----| --|--> growth               `}--> first client will get (z+d) height/width
+     *      |   |----| --|--> growth               `}--> first client will get (z+r) height/width
      *      |   |    |   |                          |
      *      |   |----|   }--> screen height - hh  --'
      *      |   |    | }-|--> client height - z       :: 2 stack clients on tile mode ..looks like a spaceship
@@ -1099,130 +1995,186 @@ void stack(int hh, int cy) {
      *     growth is left out and will later be added to the first's client height/width
      *     before that, there will be cases when the num of windows is not perfectly
      *     divided with then available screen height/width (ie 100px scr. height, and 3 windows)
-     *     so we get that remaining space and merge growth to it (d) : (z - growth) % n + growth
+     *     so we get that remaining space and merge growth to it (r) : (z - growth) % n + growth
      *     finally we know each client's height, and how many pixels should be added to
      *     the first stack window so that it satisfies growth, and doesn't create gaps
      *     on the bottom of the screen.  */
     if (!c) return; else if (!n) {
-        xcb_move_resize(dis, c->win, 0, cy, ww - 2*BORDER_WIDTH, hh - 2*BORDER_WIDTH);
+        client_move_resize(c, 0, cy, ww - 2*BORDER_WIDTH, hh - 2*BORDER_WIDTH);
         return;
-    } else if (n > 1) { d = (z - growth)%n + growth; z = (z - growth)/n; }
+    } else if (n > 1) { r = (z - d->growth)%n + d->growth; z = (z - d->growth)/n; }
 
     /* tile the first non-floating, non-fullscreen window to cover the master area */
-    if (b) xcb_move_resize(dis, c->win, 0, cy, ww - 2*BORDER_WIDTH, ma - BORDER_WIDTH);
-    else   xcb_move_resize(dis, c->win, 0, cy, ma - BORDER_WIDTH, hh - 2*BORDER_WIDTH);
+    if (b) client_move_resize(c, 0, cy, ww - 2*BORDER_WIDTH, ma - BORDER_WIDTH);
+    else   client_move_resize(c, 0, cy, ma - BORDER_WIDTH, hh - 2*BORDER_WIDTH);
 
-    /* tile the next non-floating, non-fullscreen (first) stack window with growth|d */
-    for (c=c->next; c && ISFFT(c); c=c->next);
+    /* tile the next non-floating, non-fullscreen (first) stack window with growth|r */
+    c = tiled[1];
     int cx = b ? 0:ma, cw = (b ? hh:ww) - 2*BORDER_WIDTH - ma, ch = z - BORDER_WIDTH;
-    if (b) xcb_move_resize(dis, c->win, cx, cy += ma, ch - BORDER_WIDTH + d, cw);
-    else   xcb_move_resize(dis, c->win, cx, cy, cw, ch - BORDER_WIDTH + d);
+    if (b) client_move_resize(c, cx, cy += ma, ch - BORDER_WIDTH + r, cw);
+    else   client_move_resize(c, cx, cy, cw, ch - BORDER_WIDTH + r);
 
     /* tile the rest of the non-floating, non-fullscreen stack windows */
-    for (b?(cx+=ch+d):(cy+=ch+d), c=c->next; c; c=c->next) {
-        if (ISFFT(c)) continue;
-        if (b) { xcb_move_resize(dis, c->win, cx, cy, ch, cw); cx += z; }
-        else   { xcb_move_resize(dis, c->win, cx, cy, cw, ch); cy += z; }
+    b ? (cx += ch + r):(cy += ch + r);
+    for (unsigned int i = 2; i < ntiled; i++) {
+        c = tiled[i];
+        if (b) { client_move_resize(c, cx, cy, ch, cw); cx += z; }
+        else   { client_move_resize(c, cx, cy, cw, ch); cy += z; }
     }
 }
 
 /* swap master window with current or
  * if current is head swap with next
- * if current is not head, then head
- * is behind us, so move_up until we
- * are the head */
+ * if current is not head, then it
+ * becomes the head, and the clients
+ * before it move down by one */
 void swap_master() {
-    if (!current || !head->next) return;
-    if (current == head) move_down();
-    else while (current != head) move_up();
-    update_current(head);
+    desktop *d = &desktops[current_desktop];
+    if (!d->current || !d->head->next) return;
+    if (d->current == d->head) move_down();
+    else { detach(d->current, d); attach(d->current, d, d->head); tile(d); }
+    update_current(d->head, d);
 }
 
 /* switch the tiling mode and reset all floating windows */
 void switch_mode(const Arg *arg) {
-    if (mode == arg->i) for (client *c=head; c; c=c->next) c->isfloating = False;
-    mode = arg->i;
-    tile(); update_current(current);
+    desktop *d = &desktops[current_desktop];
+    if (d->mode == arg->i) for (client *c=d->head; c; c=c->next) c->flags &= ~FLOATING;
+    d->mode = arg->i;
+    tile(d); update_current(d->current, d);
     desktopinfo();
 }
 
-/* tile all windows of current desktop - call the handler tiling function */
-void tile(void) {
-    if (!head) return; /* nothing to arange */
-    layout[head->next ? mode : MONOCLE](wh + (showpanel ? 0:PANEL_HEIGHT),
-                                (TOP_PANEL && showpanel ? PANEL_HEIGHT:0));
+/* tile all windows of the given desktop
+ * the handler tiling function is called later by arrange() */
+void tile(desktop *d) {
+    d->pending |= NEED_TILE;
 }
 
 /* toggle visibility state of the panel */
 void togglepanel() {
-    showpanel = !showpanel;
-    tile();
+    desktop *d = &desktops[current_desktop];
+    d->showpanel = !d->showpanel;
+    tile(d);
 }
 
 /* windows that request to unmap should lose their
  * client, so no invisible windows exist on screen
- */
+ *
+ * the unmaps of the wm itself are counted by client_unmap() and skipped.
+ * a window withdrawn while already unmapped causes no event, so the client
+ * sends a synthetic UnmapNotify instead, which is never the wm's own.
+ * the window's state properties are removed, as it is withdrawn */
 void unmapnotify(xcb_generic_event_t *e) {
     xcb_unmap_notify_event_t *ev = (xcb_unmap_notify_event_t *)e;
-    client *c = wintoclient(ev->window);
-    if (c && ev->event != screen->root) removeclient(c);
+    client *c = NULL; desktop *d = NULL;
+    if (!wintoclient(ev->window, &c, &d)) return;
+    if (!(ev->response_type & 0x80) && c->unmaps) { c->unmaps--; return; }
+    xcb_delete_property(dis, ev->window, wmatoms[WM_STATE]);
+    xcb_delete_property(dis, ev->window, netatoms[NET_WM_STATE]);
+    removeclient(c, d);
     desktopinfo();
 }
 
-/* highlight borders and set active window and input focus
- * if given current is NULL then delete the active window property
- *
- * stack order by client properties, top to bottom:
- *  - current when floating or transient
- *  - floating or trancient windows
- *  - current when tiled
- *  - current when fullscreen
- *  - fullscreen windows
- *  - tiled windows
- *
- * a window should have borders in any case, except if
- *  - the window is the only window on screen
- *  - the window is fullscreen
- *  - the mode is MONOCLE and the window is not floating or transient */
-void update_current(client *c) {
-    if (!head) {
-        xcb_delete_property(dis, screen->root, netatoms[NET_ACTIVE]);
-        current = prevfocus = NULL;
-        return;
-    } else if (c == prevfocus) { prevfocus = prev_client(current = prevfocus ? prevfocus:head);
-    } else if (c != current) { prevfocus = current; current = c; }
-
-    /* num of n:all fl:fullscreen ft:floating/transient windows */
-    int n = 0, fl = 0, ft = 0;
-    for (c = head; c; c = c->next, ++n) if (ISFFT(c)) { fl++; if (!c->isfullscrn) ft++; }
-    xcb_window_t w[n];
-    w[(current->isfloating||current->istransient)?0:ft] = current->win;
-    for (fl += !ISFFT(current)?1:0, c = head; c; c = c->next) {
-        xcb_change_window_attributes(dis, c->win, XCB_CW_BORDER_PIXEL, (c == current ? &win_focus:&win_unfocus));
-        xcb_border_width(dis, c->win, (!head->next || c->isfullscrn
-                    || (mode == MONOCLE && !ISFFT(c))) ? 0:BORDER_WIDTH);
-        if (CLICK_TO_FOCUS) xcb_grab_button(dis, 1, c->win, XCB_EVENT_MASK_BUTTON_PRESS, XCB_GRAB_MODE_ASYNC, XCB_GRAB_MODE_ASYNC,
-           screen->root, XCB_NONE, XCB_BUTTON_INDEX_1, XCB_BUTTON_MASK_ANY);
-        if (c != current) w[c->isfullscrn ? --fl : ISFFT(c) ? --ft : --n] = c->win;
+/* set the current and previously focused client of the given desktop
+ * if given current is NULL then the active window property is deleted
+ * borders, stack order and input focus are updated by arrange(),
+ * a monocle desktop is tiled too as only its current window is sized */
+void update_current(client *c, desktop *d) {
+    if (!d->head) d->current = d->prevfocus = NULL;
+    else if (c == d->prevfocus) d->prevfocus = prev_client(d->current = d->prevfocus ? d->prevfocus:d->head, d);
+    else if (c != d->current) { d->prevfocus = d->current; d->current = c; }
+    d->pending |= NEED_FOCUS | (d->mode == MONOCLE ? NEED_TILE:0);
+}
+
+/* hash a window id to its home slot in the index
+ * the top bits of the product are taken, as its low bits only depend on the
+ * low bits of the id, which repeat across clients - every client counts its
+ * window ids up from small numbers above its own resource base */
+static inline unsigned int winindex_hash(xcb_window_t w) {
+    return (uint32_t)(w * 2654435761u) >> winshift;
+}
+
+/* add the client's window to the index, or update the
+ * desktop of an already indexed window.
+ * the table is doubled when it would become more than half full */
+void winindex_add(client *c, int desktop) {
+    winindex *i = winindex_find(c->win);
+    if (i) { i->c = c; i->desktop = desktop; return; }
+
+    if (2 * (wincount + 1) > winsize) {
+        winindex *old = wintable;
+        unsigned int oldsize = winsize;
+        winsize = winsize ? winsize * 2:64;
+        winshift = winshift == 32 ? 26:winshift - 1;
+        if (!(wintable = calloc(winsize, sizeof(winindex)))) err(EXIT_FAILURE, "cannot allocate window index");
+        for (unsigned int n = 0; n < oldsize; n++) if (old[n].win != XCB_NONE) {
+            unsigned int h = winindex_hash(old[n].win);
+            while (wintable[h].win != XCB_NONE) h = (h + 1) & (winsize - 1);
+            wintable[h] = old[n];
+        }
+        free(old);
     }
 
-    /* restack */
-    for (ft = 0; ft <= n; ++ft) xcb_raise_window(dis, w[n-ft]);
+    unsigned int h = winindex_hash(c->win);
+    while (wintable[h].win != XCB_NONE) h = (h + 1) & (winsize - 1);
+    wintable[h] = (winindex){ .win = c->win, .c = c, .desktop = desktop };
+    ++wincount;
+}
+
+/* remove the window from the index
+ * following entries of the probe run are shifted back into the
+ * hole, so lookups never need tombstones to skip over */
+void winindex_del(xcb_window_t w) {
+    winindex *i = winindex_find(w);
+    if (!i) return;
+    unsigned int hole = i - wintable, n = hole, h;
+    for (;;) {
+        wintable[hole].win = XCB_NONE;
+        do {
+            n = (n + 1) & (winsize - 1);
+            if (wintable[n].win == XCB_NONE) { --wincount; return; }
+            h = winindex_hash(wintable[n].win);
+        } while (hole <= n ? (hole < h && h <= n):(hole < h || h <= n));
+        wintable[hole] = wintable[n];
+        hole = n;
+    }
+}
 
-    xcb_change_property(dis, XCB_PROP_MODE_REPLACE, screen->root, netatoms[NET_ACTIVE], XCB_ATOM_WINDOW, 32, 1, &current->win);
-    xcb_set_input_focus(dis, XCB_INPUT_FOCUS_POINTER_ROOT, current->win, XCB_CURRENT_TIME);
-    if (CLICK_TO_FOCUS) xcb_ungrab_button(dis, XCB_BUTTON_INDEX_1, XCB_NONE, current->win);
-    tile();
+/* find the index entry of the given window, or NULL if it's not managed */
+winindex* winindex_find(xcb_window_t w) {
+    if (!wincount) return NULL;
+    for (unsigned int h = winindex_hash(w); wintable[h].win != XCB_NONE; h = (h + 1) & (winsize - 1))
+        if (wintable[h].win == w) return &wintable[h];
+    return NULL;
 }
 
-/* find to which client the given window belongs to */
-client* wintoclient(xcb_window_t w) {
-    client *c = NULL;
-    int d = 0, cd = current_desktop;
-    for (bool found = false; d<DESKTOPS && !found; ++d)
-        for (select_desktop(d), c=head; c && !(found = (w == c->win)); c=c->next);
-    if (cd != d-1) select_desktop(cd);
-    return c;
+/* find to which client and desktop the given window belongs to
+ * c and d may be NULL when the caller is not interested in them */
+bool wintoclient(xcb_window_t w, client **c, desktop **d) {
+    winindex *i = winindex_find(w);
+    if (!i) return false;
+    if (c) *c = i->c;
+    if (d) *d = &desktops[i->desktop];
+    return true;
+}
+
+/* an error is received when a request failed
+ * a ConfigureWindow fails as a whole when the sibling it stacks the window
+ * relative to is already destroyed, but its DestroyNotify wasn't handled
+ * yet. the client's cache already holds what was lost, so it is sent again
+ * and the window restacked relative to the windows still there */
+void xerror(xcb_generic_event_t *e) {
+    xcb_generic_error_t *ev = (xcb_generic_error_t*)e;
+    DEBUGP("xcb: error: %d request: %d\n", ev->error_code, ev->major_code);
+    if (ev->major_code != XCB_CONFIGURE_WINDOW) return;
+    for (int i = 0; i < DESKTOPS; i++) for (client *c = desktops[i].head; c; c = c->next)
+        if (c->cfgseq == ev->full_sequence) {
+            c->config |= XCB_MOVE_RESIZE|XCB_CONFIG_WINDOW_BORDER_WIDTH;
+            c->stackpos = -1;
+            desktops[i].pending |= NEED_FOCUS;
+            return;
+        }
 }
 
 int main(int argc, char *argv[]) {